@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Region allocator for core, IR and type nodes. Allocation bumps a pointer
+// through large chunks; individual frees are no-ops and all memory is released
+// at once when the arena is destroyed. Nodes allocated from an arena must not
+// outlive it.
+struct arena {
+    arena(std::size_t chunk_size = 1 << 16) : chunk_size_(chunk_size) {}
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    void* allocate(std::size_t bytes, std::size_t align) {
+        auto p = (char*)(((std::uintptr_t)cur_ + align - 1) & ~(std::uintptr_t)(align - 1));
+        if (!cur_ || p + bytes > end_) {
+            auto size = std::max(chunk_size_, bytes + align);
+            chunks_.emplace_back(new char[size]);
+            reserved_ += size;
+            cur_ = chunks_.back().get();
+            end_ = cur_ + size;
+            p = (char*)(((std::uintptr_t)cur_ + align - 1) & ~(std::uintptr_t)(align - 1));
+        }
+        cur_ = p + bytes;
+        allocated_ += bytes;
+        return p;
+    }
+
+    // Returns a new arena that is released together with this one, for use by
+    // another thread. Forking is thread-safe; allocation is not.
+    arena& fork() {
+        std::lock_guard<std::mutex> lock(children_mutex_);
+        children_.push_back(std::make_unique<arena>(chunk_size_));
+        return *children_.back();
+    }
+
+    // Totals include forked arenas; read them once those are no longer in use.
+    std::size_t bytes_allocated() const {
+        std::lock_guard<std::mutex> lock(children_mutex_);
+        auto n = allocated_;
+        for (auto& c: children_) n += c->bytes_allocated();
+        return n;
+    }
+
+    std::size_t bytes_reserved() const {
+        std::lock_guard<std::mutex> lock(children_mutex_);
+        auto n = reserved_;
+        for (auto& c: children_) n += c->bytes_reserved();
+        return n;
+    }
+
+    // The arena that make_node allocates from on this thread, if any.
+    static arena*& current() {
+        static thread_local arena* current_ = nullptr;
+        return current_;
+    }
+
+private:
+    std::size_t chunk_size_;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char* cur_ = nullptr;
+    char* end_ = nullptr;
+    std::size_t allocated_ = 0;
+    std::size_t reserved_  = 0;
+
+    mutable std::mutex children_mutex_;
+    std::vector<std::unique_ptr<arena>> children_;
+};
+
+// Makes `a` the current arena of this thread for the lifetime of the scope.
+// With a null arena, make_node allocates from the heap.
+struct arena_scope {
+    arena* prev_;
+
+    arena_scope(arena& a) : arena_scope(&a) {}
+
+    arena_scope(arena* a) : prev_(arena::current()) {
+        arena::current() = a;
+    }
+
+    ~arena_scope() {
+        arena::current() = prev_;
+    }
+};
+
+template <typename T>
+struct arena_allocator {
+    using value_type = T;
+
+    arena* arena_;
+
+    arena_allocator(arena* a) : arena_(a) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena_(other.arena_) {}
+
+    T* allocate(std::size_t n) {
+        return (T*)arena_->allocate(n*sizeof(T), alignof(T));
+    }
+
+    void deallocate(T*, std::size_t) {}
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const {
+        return arena_ != other.arena_;
+    }
+};
+
+// Allocates a node from the current arena, or from the heap if there is none.
+// The node and its reference count share one allocation either way.
+template <typename T, typename... Args>
+std::shared_ptr<T> make_node(Args&&... args) {
+    if (auto a = arena::current()) {
+        return std::allocate_shared<T>(arena_allocator<T>(a), std::forward<Args>(args)...);
+    }
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
@@ -0,0 +1,315 @@
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+#include "incremental.hpp"
+#include "parser.hpp"
+#include "serialize.hpp"
+#include "ssa.hpp"
+
+// Generates synthetic programs of a given shape and size and times every
+// compilation stage on them, from 10^3 up to a maximum number of IR nodes.
+//
+//   bench [max_nodes] [shape...]
+//
+// Shapes: deep (long let chains), wide (balanced binary trees), fields (large
+// structs), calls (many call sites), catalogue (many functions). Prints one JSON
+// object per run. Function bodies are compiled on all hardware threads.
+//
+//   bench recompile
+//
+// checks that repeatedly editing and recompiling one function of a catalogue
+// keeps resident memory flat, and exits with 1 if it does not.
+
+using namespace core;
+
+namespace {
+
+const unsigned num_params = 8;
+
+expr_ptr param_field(unsigned i) {
+    return make_node<access_expr>("p", "f" + std::to_string(i % num_params));
+}
+
+std::vector<typed_var> float_fields(const std::string& prefix, unsigned n) {
+    std::vector<typed_var> fields;
+    for (unsigned i = 0; i < n; ++i) {
+        fields.push_back({prefix + std::to_string(i), "float"});
+    }
+    return fields;
+}
+
+expr_ptr param_struct() {
+    return make_node<struct_expr>("param", float_fields("f", num_params));
+}
+
+expr_ptr var(const std::string& name) {
+    return make_node<varref_expr>(name);
+}
+
+// A let chain of `n` groups of four lets: a constant, a foldable product, a live
+// update that reloads a parameter field, and a dead product.
+expr_ptr let_chain(unsigned n) {
+    std::vector<std::pair<typed_var, expr_ptr>> lets;
+    std::string live = "x";
+    lets.push_back({{live, "float"}, param_field(0)});
+
+    for (unsigned i = 0; i < n; ++i) {
+        auto id = std::to_string(i);
+        auto next = "x" + id;
+        lets.push_back({{"c" + id, "float"}, make_node<float_expr>(0.5 + i % 7)});
+        lets.push_back({{"k" + id, "float"}, make_node<binary_expr>(var("c" + id), var("c" + id), mul)});
+        lets.push_back({{next, "float"}, make_node<binary_expr>(make_node<binary_expr>(var(live), param_field(i), mul), var("k" + id), add)});
+        lets.push_back({{"d" + id, "float"}, make_node<binary_expr>(var(next), var(next), mul)});
+        live = next;
+    }
+
+    expr_ptr body = var(live);
+    for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+        body = make_node<let_expr>(it->first, it->second, body);
+    }
+    return body;
+}
+
+std::shared_ptr<block_expr> deep(unsigned n) {
+    auto f = make_node<func_expr>("float", "f", std::vector<typed_var>{{"p", "param"}}, let_chain(n));
+    return make_node<block_expr>(std::vector<expr_ptr>{param_struct(), f});
+}
+
+// `n` independent functions, each a short let chain, as in a mechanism catalogue.
+std::shared_ptr<block_expr> catalogue(unsigned n) {
+    std::vector<expr_ptr> statements = {param_struct()};
+    for (unsigned i = 0; i < n; ++i) {
+        statements.push_back(make_node<func_expr>("float", "f" + std::to_string(i), std::vector<typed_var>{{"p", "param"}}, let_chain(25)));
+    }
+    return make_node<block_expr>(statements);
+}
+
+expr_ptr tree(unsigned first, unsigned count, unsigned depth) {
+    if (count == 1) {
+        return param_field(first);
+    }
+    auto half = count/2;
+    return make_node<binary_expr>(tree(first, half, depth+1), tree(first+half, count-half, depth+1), depth%2? mul: add);
+}
+
+// One expression: a balanced binary tree with `n` parameter leaves.
+std::shared_ptr<block_expr> wide(unsigned n) {
+    auto f = make_node<func_expr>("float", "f", std::vector<typed_var>{{"p", "param"}}, tree(0, n, 0));
+    return make_node<block_expr>(std::vector<expr_ptr>{param_struct(), f});
+}
+
+// A struct of `n` fields, each created from a product of parameters.
+std::shared_ptr<block_expr> fields(unsigned n) {
+    auto big = make_node<struct_expr>("big", float_fields("g", n));
+    std::vector<expr_ptr> values;
+    for (unsigned i = 0; i < n; ++i) {
+        values.push_back(make_node<binary_expr>(param_field(i), param_field(i/num_params + 1), mul));
+    }
+    auto f = make_node<func_expr>("big", "f", std::vector<typed_var>{{"p", "param"}}, make_node<create_expr>("big", values));
+    return make_node<block_expr>(std::vector<expr_ptr>{param_struct(), big, f});
+}
+
+// A helper function called from `n` sites of an accumulating let chain.
+std::shared_ptr<block_expr> calls(unsigned n) {
+    auto helper_body = make_node<binary_expr>(make_node<binary_expr>(param_field(0), param_field(1), mul), param_field(2), add);
+    auto h = make_node<func_expr>("float", "h", std::vector<typed_var>{{"p", "param"}}, helper_body);
+
+    expr_ptr body = var("y" + std::to_string(n));
+    for (unsigned i = n; i > 0; --i) {
+        auto call = make_node<apply_expr>("h", std::vector<expr_ptr>{var("p")});
+        auto val = make_node<binary_expr>(var("y" + std::to_string(i-1)), call, add);
+        body = make_node<let_expr>(typed_var{"y" + std::to_string(i), "float"}, val, body);
+    }
+    body = make_node<let_expr>(typed_var{"y0", "float"}, param_field(0), body);
+
+    auto f = make_node<func_expr>("float", "f", std::vector<typed_var>{{"p", "param"}}, body);
+    return make_node<block_expr>(std::vector<expr_ptr>{param_struct(), h, f});
+}
+
+using generator = std::shared_ptr<block_expr> (*)(unsigned);
+
+// A copy of `b` whose statement `i`, a function, has one more (dead) let,
+// bound to `value`.
+std::shared_ptr<block_expr> edit_function(const block_expr& b, std::size_t i, double value) {
+    auto statements = b.statements_;
+    auto f = statements[i]->is_func();
+    std::vector<typed_var> args;
+    for (auto& a: f->args_) {
+        args.push_back({a->is_vardef()->var_, a->is_vardef()->type_});
+    }
+    auto body = make_node<let_expr>(typed_var{"edit", "float"}, make_node<float_expr>(value), f->body_);
+    statements[i] = make_node<func_expr>(f->ret_, f->name_, args, body);
+    return make_node<block_expr>(statements);
+}
+
+std::size_t count_nodes(const ir::ir_ptr& e) {
+    auto counter = ir::node_count();
+    e->accept(counter);
+    return counter.count_;
+}
+
+void run(const std::string& shape, generator gen, std::size_t nodes) {
+    // Size the generator from a small calibration run.
+    std::size_t per_unit;
+    {
+        arena a;
+        arena_scope scope(a);
+        type_context types;
+        type_scope types_scope(types);
+        per_unit = std::max<std::size_t>(1, count_nodes(create_arblang_ir(gen(100))) / 100);
+    }
+    unsigned n = std::max<std::size_t>(1, nodes / per_unit);
+
+    arena a;
+    arena_scope scope(a);
+    type_context types;
+    type_scope types_scope(types);
+
+    auto t0 = std::chrono::steady_clock::now();
+    auto program = gen(n);
+    auto t1 = std::chrono::steady_clock::now();
+
+    // Time parsing the printed program; compile what was parsed.
+    std::stringstream source;
+    auto printer = core::print(source);
+    program->accept(printer);
+    auto text = source.str();
+    auto tp = std::chrono::steady_clock::now();
+    program = core::parse(text);
+    t1 = std::chrono::steady_clock::now();
+    auto parse_seconds = std::chrono::duration<double>(t1 - tp).count();
+
+    auto nested = create_arblang_ir(program);
+    auto t2 = std::chrono::steady_clock::now();
+
+    auto passes = pass_manager();
+    passes.parse(standard_pipeline);
+    passes.run(nested);
+
+    auto t3 = std::chrono::steady_clock::now();
+    auto flat = ir::to_ssa(nested);
+    auto t4 = std::chrono::steady_clock::now();
+    auto lowered = ir::from_ssa(flat);
+    auto t5 = std::chrono::steady_clock::now();
+
+    auto path = (std::filesystem::temp_directory_path() / ("arblang-bench-" + std::to_string(getpid()) + ".ir")).string();
+    ir::save_program(nested, path);
+    auto t6 = std::chrono::steady_clock::now();
+    auto loaded = ir::load_program(path);
+    auto t7 = std::chrono::steady_clock::now();
+    auto ir_bytes = std::filesystem::file_size(path);
+    std::filesystem::remove(path);
+
+    // Recompile after editing one function, reusing the rest.
+    incremental_compiler session;
+    session.compile(program);
+    auto edited = edit_function(*program, program->statements_.size() - 1, 1);
+    auto t8 = std::chrono::steady_clock::now();
+    session.compile(edited);
+    auto t9 = std::chrono::steady_clock::now();
+
+    std::cout << "{\"shape\": \"" << shape << "\", \"n\": " << n
+              << ", \"nodes\": " << passes.stats_.front().nodes_before
+              << ", \"generate\": " << std::chrono::duration<double>(t1 - t0).count()
+              << ", \"source_bytes\": " << text.size()
+              << ", \"parse\": " << parse_seconds
+              << ", \"create_arblang_ir\": " << std::chrono::duration<double>(t2 - t1).count();
+    for (auto& s: passes.stats_) {
+        std::cout << ", \"" << s.name << (&s == &passes.stats_.back()? "_final": "") << "\": " << s.seconds;
+    }
+    std::cout << ", \"to_ssa\": " << std::chrono::duration<double>(t4 - t3).count()
+              << ", \"from_ssa\": " << std::chrono::duration<double>(t5 - t4).count()
+              << ", \"save\": " << std::chrono::duration<double>(t6 - t5).count()
+              << ", \"load\": " << std::chrono::duration<double>(t7 - t6).count()
+              << ", \"ir_bytes\": " << ir_bytes
+              << ", \"recompile\": " << std::chrono::duration<double>(t9 - t8).count()
+              << ", \"recompiled_functions\": " << session.compiled();
+    std::cout << ", \"nodes_after\": " << passes.stats_.back().nodes_after
+              << ", \"arena_bytes\": " << a.bytes_allocated() << "}" << std::endl;
+}
+
+// Resident memory of this process, in bytes.
+std::size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Edits one function of a catalogue of `n` at a time, `edits` times, and
+// recompiles after each edit in one incremental session, dropping the previous
+// program. The cache and every dropped program must be released, so resident
+// memory must stay flat once the allocator has warmed up; returns false if it
+// grew by more than `max_growth` bytes over the last nine tenths of the edits.
+bool recompile(unsigned n, unsigned edits, std::size_t max_growth) {
+    // The sources live on the heap, so that replaced functions are freed too.
+    auto base = catalogue(n);
+    incremental_compiler session;
+
+    auto t0 = std::chrono::steady_clock::now();
+    session.compile(base);
+    auto t1 = std::chrono::steady_clock::now();
+
+    auto current = base;
+    std::size_t rss_warm = 0;
+    double seconds = 0;
+    for (unsigned e = 0; e < edits; ++e) {
+        // Function `i` replaces its last edit, if any, with a new one.
+        auto i = 1 + e % n;
+        auto statements = current->statements_;
+        statements[i] = edit_function(*base, i, e)->statements_[i];
+        current = make_node<block_expr>(statements);
+
+        auto t2 = std::chrono::steady_clock::now();
+        auto program = session.compile(current);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t2).count();
+        if (e == edits/10) {
+            rss_warm = resident_bytes();
+        }
+    }
+    auto rss_end = resident_bytes();
+    bool flat = rss_end <= rss_warm + max_growth;
+
+    std::cout << "{\"shape\": \"recompile\", \"functions\": " << n
+              << ", \"edits\": " << edits
+              << ", \"build\": " << std::chrono::duration<double>(t1 - t0).count()
+              << ", \"recompile\": " << seconds/edits
+              << ", \"recompiled_functions\": " << session.compiled()
+              << ", \"rss_warm\": " << rss_warm
+              << ", \"rss_end\": " << rss_end
+              << ", \"flat\": " << (flat? "true": "false") << "}" << std::endl;
+    return flat;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "recompile") {
+        return recompile(300, 200, 1 << 20)? 0: 1;
+    }
+
+    std::size_t max_nodes = 1000000;
+    std::vector<std::string> shapes;
+    if (argc > 1) {
+        max_nodes = std::strtoull(argv[1], nullptr, 10);
+    }
+    for (int i = 2; i < argc; ++i) {
+        shapes.push_back(argv[i]);
+    }
+
+    std::vector<std::pair<std::string, generator>> generators = {
+        {"deep", deep}, {"wide", wide}, {"fields", fields}, {"calls", calls}, {"catalogue", catalogue}
+    };
+    for (auto& g: generators) {
+        if (!shapes.empty() && std::find(shapes.begin(), shapes.end(), g.first) == shapes.end()) {
+            continue;
+        }
+        for (std::size_t nodes = 1000; nodes <= max_nodes; nodes *= 10) {
+            run(g.first, g.second, nodes);
+        }
+    }
+    return 0;
+}
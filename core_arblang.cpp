@@ -26,6 +26,15 @@ void varref_expr::accept(visitor& v) {
     v.visit(*this);
 }
 
+// Releases the chain of bodies iteratively, so that destroying a long chain
+// does not recurse once per let.
+let_expr::~let_expr() {
+    auto body = std::move(body_);
+    while (body && body.use_count() == 1 && body->is_let()) {
+        body = std::move(body->is_let()->body_);
+    }
+}
+
 void let_expr::accept(visitor& v) {
     v.visit(*this);
 }
@@ -7,6 +7,8 @@
 #include <string>
 #include <vector>
 
+#include "arena.hpp"
+
 //Desugared language
 namespace core {
 
@@ -31,6 +33,12 @@ struct typed_var {
     std::string type;
 };
 
+// Position of a node in the source it was parsed from; 0 when built in code.
+struct source_location {
+    unsigned line   = 0;
+    unsigned column = 0;
+};
+
 enum operation {
     add,
     sub,
@@ -53,6 +61,8 @@ struct expression {
     virtual apply_expr*   is_apply()    {return nullptr;}
     virtual block_expr*   is_block()    {return nullptr;}
     virtual halt_expr*    is_halt()     {return nullptr;}
+
+    source_location loc_;
 };
 
 using expr_ptr = std::shared_ptr<expression>;
@@ -66,7 +76,7 @@ struct func_expr : expression {
     func_expr(std::string ret, std::string name, std::vector<typed_var> args, expr_ptr body)
     : ret_(ret), name_(name), body_(body) {
         for (const auto& t: args) {
-            args_.emplace_back(std::make_shared<vardef_expr>(t.var, t.type));
+            args_.emplace_back(make_node<vardef_expr>(t.var, t.type));
         }
     }
 
@@ -81,7 +91,7 @@ struct struct_expr : expression {
 
     struct_expr(std::string name, std::vector<typed_var> fields) : name_(name) {
         for (const auto& t: fields) {
-            fields_.emplace_back(std::make_shared<vardef_expr>(t.var, t.type));
+            fields_.emplace_back(make_node<vardef_expr>(t.var, t.type));
         }
     }
 
@@ -127,7 +137,9 @@ struct let_expr : expression {
     expr_ptr body_;
 
     let_expr(typed_var var, expr_ptr val, expr_ptr body) :
-    var_(std::make_shared<vardef_expr>(var.var, var.type)), val_(val), body_(body) {}
+    var_(make_node<vardef_expr>(var.var, var.type)), val_(val), body_(body) {}
+
+    ~let_expr();
 
     void accept(visitor& v) override;
 
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+#include "visitor.hpp"
+
+namespace ir {
+
+struct batch_instruction {
+    enum kind {
+        constant,   // dst = val
+        binary,     // dst = lhs op rhs
+        fma,        // dst = (+/-)lhs*rhs (+/-)aux, rounded once
+        intrinsic   // dst = fn(lhs) or fn(lhs, rhs)
+    };
+
+    kind      kind_;
+    operation op_;
+    unsigned  dst_, lhs_, rhs_;
+    double    val_;
+    unsigned  aux_ = 0;
+    bool      negate_product_ = false;
+    bool      negate_addend_  = false;
+    ir::intrinsic fn_ = ir::intrinsic::exp;
+};
+
+// A function body lowered to straight-line column operations.
+// Slots [0, num_inputs_) are the argument columns, in argument order;
+// slots [num_inputs_, num_inputs_ + num_temps_) are temporaries.
+// Columns hold floats or doubles, as the precision of the float type.
+struct batch_kernel {
+    unsigned num_inputs_ = 0;
+    unsigned num_temps_  = 0;
+    std::size_t block_   = 512;   // lanes per tile
+    precision precision_ = precision::f64;
+    std::vector<batch_instruction> code_;
+    std::vector<unsigned> outputs_;   // slot of every result column
+
+    unsigned num_outputs() const {
+        return outputs_.size();
+    }
+
+    // Evaluate `n` instances: `in` holds `num_inputs_` columns and `out`
+    // holds `num_outputs()` columns, each of length `n`. T is float for an
+    // f32 kernel and double for an f64 one.
+    //
+    // The instances are run in tiles of `block_` lanes, one instruction over
+    // the whole tile at a time, so the temporaries of a tile stay in cache
+    // from one instruction to the next.
+    template <typename T>
+    void run(std::size_t n, const T* const* in, T* const* out) const {
+        if (precision_ != (sizeof(T) == sizeof(float)? precision::f32: precision::f64)) {
+            throw std::runtime_error("Cannot run batch kernel: columns do not match the kernel's precision");
+        }
+        std::size_t block = std::max<std::size_t>(1, std::min(block_, n));
+        std::vector<T> temps((std::size_t)num_temps_*block);
+        std::vector<const T*> src(num_inputs_ + num_temps_);
+
+        for (unsigned i = 0; i < num_temps_; ++i) {
+            src[num_inputs_ + i] = temps.data() + (std::size_t)i*block;
+        }
+        for (std::size_t first = 0; first < n; first += block) {
+            for (unsigned i = 0; i < num_inputs_; ++i) {
+                src[i] = in[i] + first;
+            }
+            auto m = std::min(block, n - first);
+            run_tile(m, src.data(), temps.data(), block);
+            for (unsigned i = 0; i < outputs_.size(); ++i) {
+                std::copy(src[outputs_[i]], src[outputs_[i]]+m, out[i] + first);
+            }
+        }
+    }
+
+private:
+    // Runs the code on `n` lanes; temporary slot s is temps[(s - num_inputs_)*stride, ...).
+    template <typename T>
+    void run_tile(std::size_t n, const T* const* src, T* temps, std::size_t stride) const {
+        auto dst = [&](unsigned slot) {
+            return temps + (std::size_t)(slot - num_inputs_)*stride;
+        };
+
+        for (auto& c: code_) {
+            T* d = dst(c.dst_);
+            switch (c.kind_) {
+                case batch_instruction::constant: {
+                    std::fill(d, d+n, (T)c.val_);
+                    break;
+                }
+                case batch_instruction::binary: {
+                    const T* a = src[c.lhs_];
+                    const T* b = src[c.rhs_];
+                    switch (c.op_) {
+                        case operation::add: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = a[i] + b[i];
+                            break;
+                        }
+                        case operation::sub: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = a[i] - b[i];
+                            break;
+                        }
+                        case operation::mul: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = a[i] * b[i];
+                            break;
+                        }
+                        case operation::div: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = a[i] / b[i];
+                            break;
+                        }
+                    }
+                    break;
+                }
+                case batch_instruction::fma: {
+                    const T* a = src[c.lhs_];
+                    const T* b = src[c.rhs_];
+                    const T* x = src[c.aux_];
+                    T sp = c.negate_product_? -1: 1;
+                    T sa = c.negate_addend_?  -1: 1;
+                    for (std::size_t i = 0; i < n; ++i) d[i] = std::fma(sp*a[i], b[i], sa*x[i]);
+                    break;
+                }
+                case batch_instruction::intrinsic: {
+                    const T* a = src[c.lhs_];
+                    const T* b = src[c.rhs_];
+                    switch (c.fn_) {
+                        case ir::intrinsic::exp: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = vmath::exp(a[i]);
+                            break;
+                        }
+                        case ir::intrinsic::log: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = vmath::log(a[i]);
+                            break;
+                        }
+                        case ir::intrinsic::pow: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = vmath::pow(a[i], b[i]);
+                            break;
+                        }
+                        case ir::intrinsic::exprelr: {
+                            for (std::size_t i = 0; i < n; ++i) d[i] = vmath::exprelr(a[i]);
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+};
+
+// Calls f(slot) for every slot read by `c`.
+template <typename F>
+void for_each_operand(const batch_instruction& c, F&& f) {
+    switch (c.kind_) {
+        case batch_instruction::constant:
+            break;
+        case batch_instruction::fma:
+            f(c.aux_);
+            [[fallthrough]];
+        case batch_instruction::binary:
+        case batch_instruction::intrinsic:
+            f(c.lhs_);
+            f(c.rhs_);
+            break;
+    }
+}
+
+// Liveness of the slots of a kernel whose every temporary slot is defined by
+// exactly one instruction: the index of the last instruction reading each
+// slot. Results are read after the code, at code_.size(); a slot never read
+// dies where it is defined.
+inline std::vector<std::size_t> last_reads(const batch_kernel& k) {
+    std::vector<std::size_t> last(k.num_inputs_ + k.num_temps_, 0);
+    for (std::size_t i = 0; i < k.code_.size(); ++i) {
+        last[k.code_[i].dst_] = i;
+        for_each_operand(k.code_[i], [&](unsigned s) {last[s] = i;});
+    }
+    for (auto s: k.outputs_) {
+        last[s] = k.code_.size();
+    }
+    return last;
+}
+
+// Renumbers the temporary slots of a kernel, as lowered by batch_compiler,
+// so that temporaries whose live ranges do not overlap share a slot, and
+// num_temps_ becomes the largest number live at once. Slots are assigned in
+// one linear scan: a slot is freed after the last read of its value and
+// reused by the next definition, most recently freed first, so reuse hits
+// cache. A definition may reuse a slot its own operands free, which is safe
+// as every instruction works lane by lane.
+//
+// With `pin_constants`, constants take the first temporary slots, in order,
+// for their whole run, for executors that load them once.
+inline void allocate_slots(batch_kernel& k, bool pin_constants = false) {
+    auto last = last_reads(k);
+    auto end = k.code_.size();
+    std::vector<unsigned> slot(k.num_inputs_ + k.num_temps_);
+    std::vector<bool> defined(slot.size(), false);
+    for (unsigned i = 0; i < k.num_inputs_; ++i) {
+        slot[i] = i;
+    }
+
+    unsigned next = k.num_inputs_;
+    if (pin_constants) {
+        for (auto& c: k.code_) {
+            if (c.kind_ == batch_instruction::constant) {
+                slot[c.dst_] = next++;
+                last[c.dst_] = end + 1;
+            }
+        }
+    }
+
+    std::vector<unsigned> free;
+    for (std::size_t i = 0; i < k.code_.size(); ++i) {
+        auto& c = k.code_[i];
+        if (c.dst_ < k.num_inputs_ || defined[c.dst_]) {
+            throw std::runtime_error("Cannot allocate slots: slot " + std::to_string(c.dst_) + " is defined twice");
+        }
+        defined[c.dst_] = true;
+
+        for_each_operand(c, [&](unsigned s) {
+            if (s >= k.num_inputs_ && last[s] == i) {
+                free.push_back(slot[s]);
+                last[s] = end + 1;   // freed once, even if read twice
+            }
+        });
+        if (c.kind_ != batch_instruction::constant) {
+            c.lhs_ = slot[c.lhs_];
+            c.rhs_ = slot[c.rhs_];
+        }
+        if (c.kind_ == batch_instruction::fma) {
+            c.aux_ = slot[c.aux_];
+        }
+
+        auto dst = c.dst_;
+        if (pin_constants && c.kind_ == batch_instruction::constant) {
+            c.dst_ = slot[dst];
+            continue;
+        }
+        if (free.empty()) {
+            slot[dst] = next++;
+        } else {
+            slot[dst] = free.back();
+            free.pop_back();
+        }
+        c.dst_ = slot[dst];
+        if (last[dst] == i) {
+            free.push_back(slot[dst]);   // never read
+        }
+    }
+
+    for (auto& s: k.outputs_) {
+        s = slot[s];
+    }
+    k.num_temps_ = next - k.num_inputs_;
+}
+
+// Lowers a canonical function body to a batch_kernel. Every value is
+// resolved to the list of slots holding its columns, so accesses, creates
+// and copies cost nothing at run time and calls are inlined. Every
+// temporary slot is defined once; see allocate_slots.
+struct batch_compiler : column_lowering<unsigned> {
+    std::unordered_map<std::uint64_t, unsigned> constants_;     // bits of value -> slot, so -0 and 0 stay apart
+
+    batch_kernel kernel_;
+
+    batch_compiler(const ir_ptr& program) : column_lowering(program, "Cannot compile batch kernel") {}
+
+    batch_kernel compile(const std::string& name) {
+        auto& f = function(name);
+
+        kernel_ = {};
+        kernel_.precision_ = float_precision(f.type());
+        values_.clear();
+        constants_.clear();
+
+        for (auto& a: f.args_) {
+            std::vector<unsigned> slots(column_count(a->type()));
+            for (auto& s: slots) {
+                s = kernel_.num_inputs_++;
+            }
+            values_[a.get()] = slots;
+        }
+
+        f.body_->accept(*this);
+        kernel_.outputs_ = result_;
+        return kernel_;
+    }
+
+    void visit(float_rep& e) override {
+        std::uint64_t bits;
+        std::memcpy(&bits, &e.val_, sizeof(bits));
+        auto it = constants_.find(bits);
+        if (it == constants_.end()) {
+            auto slot = temp();
+            kernel_.code_.push_back({batch_instruction::constant, operation::add, slot, 0, 0, e.val_});
+            it = constants_.insert({bits, slot}).first;
+        }
+        result_ = {it->second};
+    }
+
+    void visit(binary_rep& e) override {
+        e.lhs_->accept(*this);
+        auto lhs = result_.front();
+        e.rhs_->accept(*this);
+        auto rhs = result_.front();
+
+        auto slot = temp();
+        kernel_.code_.push_back({batch_instruction::binary, e.op_, slot, lhs, rhs, 0});
+        result_ = {slot};
+    }
+
+    void visit(fma_rep& e) override {
+        e.lhs_->accept(*this);
+        auto lhs = result_.front();
+        e.rhs_->accept(*this);
+        auto rhs = result_.front();
+        e.addend_->accept(*this);
+        auto addend = result_.front();
+
+        auto slot = temp();
+        kernel_.code_.push_back({batch_instruction::fma, operation::add, slot, lhs, rhs, 0, addend, e.negate_product_, e.negate_addend_});
+        result_ = {slot};
+    }
+
+    void visit(intrinsic_rep& e) override {
+        unsigned args[2];
+        for (unsigned i = 0; i < e.args_.size(); ++i) {
+            e.args_[i]->accept(*this);
+            args[i] = result_.front();
+        }
+        auto rhs = e.args_.size() > 1? args[1]: args[0];
+
+        auto slot = temp();
+        kernel_.code_.push_back({batch_instruction::intrinsic, operation::add, slot, args[0], rhs, 0, 0, false, false, e.fn_});
+        result_ = {slot};
+    }
+
+private:
+    unsigned temp() {
+        return kernel_.num_inputs_ + kernel_.num_temps_++;
+    }
+};
+
+// Compiles function `name` of `program`, with its temporaries allocated by
+// liveness, so a tile's working set is only as large as the values live at once.
+inline batch_kernel compile_batch_kernel(const ir_ptr& program, const std::string& name) {
+    auto k = batch_compiler(program).compile(name);
+    allocate_slots(k);
+    return k;
+}
+
+} //namespace ir
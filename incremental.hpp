@@ -0,0 +1,57 @@
+#pragma once
+
+#include "pass_manager.hpp"
+
+// A compilation session for a program that is edited and recompiled
+// repeatedly. Functions are lowered and run through the passes once; later
+// compilations reuse every function whose definition and dependencies are
+// unchanged, and only redo the rest (see function_cache).
+//
+// Each returned program owns the arena its nodes are allocated from, and
+// frees it when the last reference to the program is dropped; nodes taken
+// out of a program must not outlive it. The session owns the cache and the
+// type context. Its float type has precision
+// `p`; kernels must be compiled in the session's type context (see types()).
+struct incremental_compiler {
+    incremental_compiler(const std::string& pipeline = standard_pipeline, unsigned num_threads = 0, precision p = precision::f64)
+        : num_threads_(num_threads), types_(p) {
+        auto passes = pass_manager().parse(pipeline);
+        for (auto& p: passes.pipeline_) {
+            passes_.push_back(p.run);
+        }
+    }
+
+    ir::ir_ptr compile(std::shared_ptr<core::block_expr> e) {
+        auto storage = std::make_shared<program_storage>();
+        arena_scope scope(storage->arena_);
+        type_scope types_scope(types_);
+        storage->program_ = create_arblang_ir(e, num_threads_, passes_, &cache_);
+        return ir::ir_ptr(storage, storage->program_.get());
+    }
+
+    // Functions reused and compiled by the last compilation.
+    unsigned reused() const {
+        return cache_.hits_;
+    }
+
+    unsigned compiled() const {
+        return cache_.misses_;
+    }
+
+    type_context& types() {
+        return types_;
+    }
+
+private:
+    // The nodes of one program are released before the arena they live in.
+    struct program_storage {
+        arena      arena_;
+        ir::ir_ptr program_;
+    };
+
+    unsigned num_threads_;
+    std::vector<function_pass> passes_;
+
+    type_context   types_;
+    function_cache cache_;
+};
@@ -3,7 +3,7 @@
 
 namespace ir {
 
-func_rep::func_rep(std::string name, type_ptr ret, std::vector<ir_ptr> args, ir_ptr body) : name_(name), args_(args), body_(body) {
+func_rep::func_rep(symbol name, type_ptr ret, std::vector<ir_ptr> args, ir_ptr body) : name_(name), args_(args), body_(body) {
     std::vector<field> typed_args;
     for (auto& a: args) {
         if (auto vr = a->is_vardef()) {
@@ -12,10 +12,10 @@ func_rep::func_rep(std::string name, type_ptr ret, std::vector<ir_ptr> args, ir_
             throw std::runtime_error("function argument of non-varref type");
         }
     }
-    type_ = std::make_shared<func_type>(name, ret, typed_args);
+    type_ = type_context::current().get_func(name, ret, typed_args);
 }
 
-struct_rep::struct_rep(std::string name, std::vector<ir_ptr> fields) : name_(name), fields_(fields) {
+struct_rep::struct_rep(symbol name, std::vector<ir_ptr> fields) : name_(name), fields_(fields) {
     std::vector<field> typed_fields;
     for (auto& f: fields) {
         if (auto vr = f->is_vardef()) {
@@ -24,7 +24,39 @@ struct_rep::struct_rep(std::string name, std::vector<ir_ptr> fields) : name_(nam
             throw std::runtime_error("struct field of non-varref type");
         }
     }
-    type_ = std::make_shared<struct_type>(name, typed_fields);
+    type_ = type_context::current().get_struct(name, typed_fields);
+}
+
+namespace {
+// Releases a chain of scopes (of lets, functions and structs) iteratively, so
+// that destroying a long function or program does not recurse once per node.
+void release_scopes(ir_ptr scope) {
+    while (scope && scope.use_count() == 1) {
+        ir_ptr* next = nullptr;
+        if (auto l = scope->is_let()) {
+            next = &l->scope_;
+        } else if (auto f = scope->is_func()) {
+            next = &f->scope_;
+        } else if (auto s = scope->is_struct()) {
+            next = &s->scope_;
+        } else {
+            break;
+        }
+        scope = std::move(*next);
+    }
+}
+}
+
+func_rep::~func_rep() {
+    release_scopes(std::move(scope_));
+}
+
+struct_rep::~struct_rep() {
+    release_scopes(std::move(scope_));
+}
+
+let_rep::~let_rep() {
+    release_scopes(std::move(scope_));
 }
 
 void ir_expression::accept(visitor& v) {
@@ -59,6 +91,14 @@ void binary_rep::accept(visitor& v) {
     v.visit(*this);
 }
 
+void fma_rep::accept(visitor& v) {
+    v.visit(*this);
+}
+
+void intrinsic_rep::accept(visitor& v) {
+    v.visit(*this);
+}
+
 void access_rep::accept(visitor& v) {
     v.visit(*this);
 }
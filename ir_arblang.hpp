@@ -22,21 +22,25 @@ struct vardef_rep;
 struct varref_rep;
 struct let_rep;
 struct binary_rep;
+struct fma_rep;
+struct intrinsic_rep;
 struct access_rep;
 struct create_rep;
 struct apply_rep;
 
 struct ir_expression {
-    virtual func_rep*    is_func()     {return nullptr;}
-    virtual struct_rep*  is_struct()   {return nullptr;}
-    virtual float_rep*   is_float()    {return nullptr;}
-    virtual vardef_rep*  is_vardef()   {return nullptr;}
-    virtual varref_rep*  is_varref()   {return nullptr;}
-    virtual let_rep*     is_let()      {return nullptr;}
-    virtual binary_rep*  is_binary()   {return nullptr;}
-    virtual access_rep*  is_access()   {return nullptr;}
-    virtual create_rep*  is_create()   {return nullptr;}
-    virtual apply_rep*   is_apply()    {return nullptr;}
+    virtual func_rep*      is_func()       {return nullptr;}
+    virtual struct_rep*    is_struct()     {return nullptr;}
+    virtual float_rep*     is_float()      {return nullptr;}
+    virtual vardef_rep*    is_vardef()     {return nullptr;}
+    virtual varref_rep*    is_varref()     {return nullptr;}
+    virtual let_rep*       is_let()        {return nullptr;}
+    virtual binary_rep*    is_binary()     {return nullptr;}
+    virtual fma_rep*       is_fma()        {return nullptr;}
+    virtual intrinsic_rep* is_intrinsic()  {return nullptr;}
+    virtual access_rep*    is_access()     {return nullptr;}
+    virtual create_rep*    is_create()     {return nullptr;}
+    virtual apply_rep*     is_apply()      {return nullptr;}
 
     virtual void accept(visitor&) = 0;
 
@@ -53,15 +57,17 @@ using ir_ptr = std::shared_ptr<ir_expression>;
 using core::operation;
 
 struct func_rep : ir_expression {
-    std::string         name_;
+    symbol              name_;
     std::vector<ir_ptr> args_;
     ir_ptr              body_;
     ir_ptr              scope_;     // The `in` part of let_s ... in ...
 
-    func_rep(std::string name, std::vector<ir_ptr> args, ir_ptr body, type_ptr type)
+    func_rep(symbol name, std::vector<ir_ptr> args, ir_ptr body, type_ptr type)
         : ir_expression(type), name_(name), args_(args), body_(body) {};
 
-    func_rep(std::string name, type_ptr ret, std::vector<ir_ptr> args, ir_ptr body);
+    func_rep(symbol name, type_ptr ret, std::vector<ir_ptr> args, ir_ptr body);
+
+    ~func_rep();
 
     void set_scope(const ir_ptr& scope) {
         scope_ = scope;
@@ -77,12 +83,13 @@ struct func_rep : ir_expression {
 };
 
 struct struct_rep : ir_expression {
-    std::string         name_;
+    symbol              name_;
     std::vector<ir_ptr> fields_;
     ir_ptr              scope_;     // The `in` part of let_s ... in ...
 
-    struct_rep(std::string name, std::vector<ir_ptr> fields);
+    struct_rep(symbol name, std::vector<ir_ptr> fields);
 
+    ~struct_rep();
 
     void set_scope(const ir_ptr& scope) {
         scope_ = scope;
@@ -96,7 +103,8 @@ struct struct_rep : ir_expression {
 struct float_rep : ir_expression {
     double val_;
 
-    float_rep(double val) : ir_expression(std::make_shared<float_type>()), val_(val) {}
+    // The value is rounded to the precision of the float type.
+    float_rep(double val) : ir_expression(type_context::current().get_float()), val_(round_to(type_->is_float()->precision_, val)) {}
 
     void accept(visitor& v) override;
 
@@ -104,9 +112,9 @@ struct float_rep : ir_expression {
 };
 
 struct vardef_rep : ir_expression {
-    std::string name_;
+    symbol name_;
 
-    vardef_rep(std::string name, type_ptr type) : ir_expression(type), name_(name) {}
+    vardef_rep(symbol name, type_ptr type) : ir_expression(type), name_(name) {}
 
     void accept(visitor& v) override;
 
@@ -132,6 +140,8 @@ struct let_rep : ir_expression {
 
     let_rep(ir_ptr var, ir_ptr val, ir_ptr scope, type_ptr type) : ir_expression(type), var_(var), val_(val), scope_(scope) {}
 
+    ~let_rep();
+
     void set_scope(const ir_ptr& scope) {
         scope_ = scope;
     }
@@ -168,6 +178,76 @@ struct binary_rep : ir_expression {
     binary_rep* is_binary() override {return this;}
 };
 
+// Fused multiply-add: lhs*rhs + addend, rounded once. The product and the
+// addend may each be negated, so mul->add and mul->sub pairs all contract.
+struct fma_rep : ir_expression {
+    ir_ptr lhs_;
+    ir_ptr rhs_;
+    ir_ptr addend_;
+    bool   negate_product_;
+    bool   negate_addend_;
+
+    fma_rep(ir_ptr lhs, ir_ptr rhs, ir_ptr addend, bool negate_product, bool negate_addend, type_ptr type)
+        : ir_expression(type), lhs_(lhs), rhs_(rhs), addend_(addend), negate_product_(negate_product), negate_addend_(negate_addend) {}
+
+    void replace_lhs(ir_ptr lhs) {
+        lhs_ = lhs;
+    }
+
+    void replace_rhs(ir_ptr rhs) {
+        rhs_ = rhs;
+    }
+
+    void replace_addend(ir_ptr addend) {
+        addend_ = addend;
+    }
+
+    void accept(visitor& v) override;
+
+    fma_rep* is_fma() override {return this;}
+};
+
+// Builtin functions of floats, applied like user functions when no function
+// of the same name is defined. All backends evaluate them with vmath.
+enum class intrinsic {exp, log, pow, exprelr};
+
+constexpr unsigned num_intrinsics = 4;
+
+inline const char* intrinsic_name(intrinsic f) {
+    static const char* names[num_intrinsics] = {"exp", "log", "pow", "exprelr"};
+    return names[(unsigned)f];
+}
+
+inline unsigned intrinsic_arity(intrinsic f) {
+    return f == intrinsic::pow? 2: 1;
+}
+
+// Looks up the intrinsic called `name`; returns false if there is none.
+inline bool find_intrinsic(const std::string& name, intrinsic& f) {
+    for (unsigned i = 0; i < num_intrinsics; ++i) {
+        if (name == intrinsic_name((intrinsic)i)) {
+            f = (intrinsic)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct intrinsic_rep : ir_expression {
+    intrinsic           fn_;
+    std::vector<ir_ptr> args_;
+
+    intrinsic_rep(intrinsic fn, std::vector<ir_ptr> args, type_ptr type) : ir_expression(type), fn_(fn), args_(args) {}
+
+    void replace_arg(unsigned i, ir_ptr arg) {
+        args_[i] = arg;
+    }
+
+    void accept(visitor& v) override;
+
+    intrinsic_rep* is_intrinsic() override {return this;}
+};
+
 struct access_rep : ir_expression {
     ir_ptr var_; //varref
     unsigned index_;
@@ -195,8 +275,10 @@ struct create_rep : ir_expression {
 
 struct apply_rep : ir_expression {
     std::vector<ir_ptr> args_;
+    type_ptr            func_;    // type of the applied function; the expression has its return type
+    func_rep*           callee_;  // definition of the applied function in the same program; null in a function_cache entry
 
-    apply_rep(std::vector<ir_ptr> args, type_ptr type) : ir_expression(type), args_(args) {}
+    apply_rep(std::vector<ir_ptr> args, type_ptr func, func_rep* callee) : ir_expression(func->is_func()->ret_), args_(args), func_(func), callee_(callee) {}
 
     void replace_arg(unsigned i, ir_ptr arg) {
         args_[i] = arg;
@@ -1,37 +1,47 @@
-#include "transform.hpp"
+#include "evaluate.hpp"
+#include "native.hpp"
+#include "pass_manager.hpp"
+#include "vm.hpp"
 
 int main() {
     using namespace core;
+
+    // Every node of this compilation is allocated from one arena, and every type interned in one context.
+    arena session;
+    arena_scope session_scope(session);
+    type_context types;
+    type_scope types_scope(types);
+
     auto core_printer = core::print(std::cout);
 
-    auto ion_state       = std::make_shared<core::struct_expr>("ion-state",       std::vector<core::typed_var>{{"iconc", "float"}, {"econc", "float"}});
-    auto current_contrib = std::make_shared<core::struct_expr>("current-contrib", std::vector<core::typed_var>{{"i", "float"}, {"g", "float"}});
-    auto cell  = std::make_shared<core::struct_expr>("cell",  std::vector<core::typed_var>{{"v", "float"}, {"temp", "float"}, {"leak", "ion-state"}});
-    auto state = std::make_shared<core::struct_expr>("state", std::vector<core::typed_var>{{"m", "float"}});
-    auto param = std::make_shared<core::struct_expr>("param", std::vector<core::typed_var>{{"g0", "float"}, {"erev", "float"}});
+    auto ion_state       = make_node<core::struct_expr>("ion-state",       std::vector<core::typed_var>{{"iconc", "float"}, {"econc", "float"}});
+    auto current_contrib = make_node<core::struct_expr>("current-contrib", std::vector<core::typed_var>{{"i", "float"}, {"g", "float"}});
+    auto cell  = make_node<core::struct_expr>("cell",  std::vector<core::typed_var>{{"v", "float"}, {"temp", "float"}, {"leak", "ion-state"}});
+    auto state = make_node<core::struct_expr>("state", std::vector<core::typed_var>{{"m", "float"}});
+    auto param = make_node<core::struct_expr>("param", std::vector<core::typed_var>{{"g0", "float"}, {"erev", "float"}});
 
-    auto v    = std::make_shared<core::access_expr>("c", "v");
-    auto erev = std::make_shared<core::access_expr>("p", "erev");
-    auto g0   = std::make_shared<core::access_expr>("p", "g0");
-    auto m    = std::make_shared<core::access_expr>("s", "m");
+    auto v    = make_node<core::access_expr>("c", "v");
+    auto erev = make_node<core::access_expr>("p", "erev");
+    auto g0   = make_node<core::access_expr>("p", "g0");
+    auto m    = make_node<core::access_expr>("s", "m");
 
-    auto i = std::make_shared<core::binary_expr>(std::make_shared<core::binary_expr>(std::make_shared<core::binary_expr>(v, erev, core::operation::sub), g0, mul), m, core::operation::mul);
-    auto accumulated_weight = std::make_shared<core::binary_expr>(std::make_shared<core::varref_expr>("a"), std::make_shared<core::varref_expr>("w"), core::operation::add);
+    auto i = make_node<core::binary_expr>(make_node<core::binary_expr>(make_node<core::binary_expr>(v, erev, core::operation::sub), g0, mul), m, core::operation::mul);
+    auto accumulated_weight = make_node<core::binary_expr>(make_node<core::varref_expr>("a"), make_node<core::varref_expr>("w"), core::operation::add);
 
-    auto weighted_i = std::make_shared<core::binary_expr>(i, accumulated_weight, core::operation::mul);
-    auto g = std::make_shared<core::binary_expr>(g0, m, operation::mul);
+    auto weighted_i = make_node<core::binary_expr>(i, accumulated_weight, core::operation::mul);
+    auto g = make_node<core::binary_expr>(g0, m, operation::mul);
 
-    auto create_curr = std::make_shared<core::create_expr>("current-contrib", std::vector<core::expr_ptr>{weighted_i, g});
+    auto create_curr = make_node<core::create_expr>("current-contrib", std::vector<core::expr_ptr>{weighted_i, g});
 
-    auto let_weighted   = std::make_shared<core::let_expr>(core::typed_var{"w", "float"}, std::make_shared<core::float_expr>(0.1), create_curr);
-    auto let_accumulate = std::make_shared<core::let_expr>(core::typed_var{"a", "float"}, std::make_shared<core::float_expr>(3), let_weighted);
+    auto let_weighted   = make_node<core::let_expr>(core::typed_var{"w", "float"}, make_node<core::float_expr>(0.1), create_curr);
+    auto let_accumulate = make_node<core::let_expr>(core::typed_var{"a", "float"}, make_node<core::float_expr>(3), let_weighted);
 
-    auto current = std::make_shared<core::func_expr>("current-contrib",
+    auto current = make_node<core::func_expr>("current-contrib",
                                                      "current",
                                                      std::vector<core::typed_var>{{"p", "param"}, {"s", "state"}, {"c", "cell"}},
                                                      let_accumulate);
 
-    auto block = std::make_shared<core::block_expr>(std::vector<core::expr_ptr>{current_contrib, ion_state, cell, state, param, current});
+    auto block = make_node<core::block_expr>(std::vector<core::expr_ptr>{current_contrib, ion_state, cell, state, param, current});
 
     block->accept(core_printer);
     std::cout << "\n------------------------------------------------------\n";
@@ -43,25 +53,97 @@ int main() {
     nested_stmt->accept(valid);
     nested_stmt->accept(ir_printer);
 
+    auto passes = pass_manager();
+    passes.validate_ = true;
+    passes.trace_ = &std::cout;
+    passes.parse(standard_pipeline);
+    passes.run(nested_stmt);
+
     std::cout << "\n------------------------------------------------------\n";
-    constant_propagate(nested_stmt);
-    nested_stmt->accept(valid);
-    nested_stmt->accept(ir_printer);
+    auto kernel = ir::compile_batch_kernel(nested_stmt, "current");
+
+    // columns: p.g0 p.erev s.m c.v c.temp c.leak.iconc c.leak.econc
+    const std::size_t n = 4;
+    std::vector<std::vector<double>> inputs = {
+        {1.0,  2.0,  0.5,  0.25},
+        {-65., -65., -70., -77.},
+        {0.1,  0.2,  0.3,  0.4},
+        {-60., -50., -40., -30.},
+        {6.3,  6.3,  6.3,  6.3},
+        {1.0,  1.0,  1.0,  1.0},
+        {2.0,  2.0,  2.0,  2.0}
+    };
+    std::vector<std::vector<double>> outputs(kernel.num_outputs(), std::vector<double>(n));
+
+    std::vector<const double*> in;
+    for (auto& c: inputs) in.push_back(c.data());
+    std::vector<double*> out;
+    for (auto& c: outputs) out.push_back(c.data());
+
+    kernel.run(n, in.data(), out.data());
+    for (std::size_t i = 0; i < n; ++i) {
+        std::cout << "current[" << i << "] = (i: " << outputs[0][i] << ", g: " << outputs[1][i] << ")\n";
+    }
+
+    auto program = ir::compile_vm_program(nested_stmt, "current");
+    for (auto& c: outputs) std::fill(c.begin(), c.end(), 0.);
+    program.run(n, in.data(), out.data());
+    for (std::size_t i = 0; i < n; ++i) {
+        std::cout << "vm current[" << i << "] = (i: " << outputs[0][i] << ", g: " << outputs[1][i] << ")\n";
+    }
 
     std::cout << "\n------------------------------------------------------\n";
-    elim_dead_code(nested_stmt);
-    nested_stmt->accept(valid);
-    nested_stmt->accept(ir_printer);
+    // The same program in single precision: literals, folding and kernels use float.
+    {
+        type_context types32(precision::f32);
+        type_scope types32_scope(types32);
+
+        auto program32 = create_arblang_ir(block);
+        pass_manager().parse(standard_pipeline).run(program32);
+        auto kernel32 = ir::compile_batch_kernel(program32, "current");
+
+        std::vector<std::vector<float>> inputs32, outputs32(kernel32.num_outputs(), std::vector<float>(n));
+        for (auto& c: inputs) inputs32.emplace_back(c.begin(), c.end());
+        std::vector<const float*> in32;
+        for (auto& c: inputs32) in32.push_back(c.data());
+        std::vector<float*> out32;
+        for (auto& c: outputs32) out32.push_back(c.data());
+
+        kernel32.run(n, in32.data(), out32.data());
+        for (std::size_t i = 0; i < n; ++i) {
+            std::cout << "f32 current[" << i << "] = (i: " << outputs32[0][i] << ", g: " << outputs32[1][i] << ")\n";
+        }
+
+        try {
+            auto native32 = ir::compile_native(program32, "current");
+            native32(n, in32.data(), out32.data());
+            for (std::size_t i = 0; i < n; ++i) {
+                std::cout << "native f32 current[" << i << "] = (i: " << outputs32[0][i] << ", g: " << outputs32[1][i] << ")\n";
+            }
+        } catch (std::exception& e) {
+            std::cout << "native backend unavailable: " << e.what() << "\n";
+        }
+    }
 
     std::cout << "\n------------------------------------------------------\n";
-    elim_common_subexpressions(nested_stmt);
-    nested_stmt->accept(valid);
-    nested_stmt->accept(ir_printer);
+    auto simd = ir::simd_kernel(std::cout, nested_stmt);
+    simd.prelude();
+    simd.kernel("current");
 
     std::cout << "\n------------------------------------------------------\n";
-    elim_dead_code(nested_stmt);
-    nested_stmt->accept(valid);
-    nested_stmt->accept(ir_printer);
+    try {
+        auto native = ir::compile_native(nested_stmt, "current");
+        for (auto& c: outputs) std::fill(c.begin(), c.end(), 0.);
+        native(n, in.data(), out.data());
+        for (std::size_t i = 0; i < n; ++i) {
+            std::cout << "native current[" << i << "] = (i: " << outputs[0][i] << ", g: " << outputs[1][i] << ")\n";
+        }
+    } catch (std::exception& e) {
+        std::cout << "native backend unavailable: " << e.what() << "\n";
+    }
+
+    std::cout << "\n------------------------------------------------------\n";
+    passes.report(std::cout);
 
     return 0;
 }
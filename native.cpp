@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include "native.hpp"
+#include "visitor.hpp"
+
+namespace ir {
+
+namespace {
+// FNV-1a, so cache keys are stable across builds and platforms.
+std::uint64_t stable_hash(const std::string& s) {
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c: s) {
+        h = (h ^ c) * 1099511628211ull;
+    }
+    return h;
+}
+
+std::filesystem::path cache_directory(const native_options& opt) {
+    if (!opt.cache_dir.empty()) {
+        return opt.cache_dir;
+    }
+    if (auto env = std::getenv("ARBLANG_CACHE_DIR")) {
+        if (!*env) {
+            throw std::runtime_error("Cannot compile kernel: ARBLANG_CACHE_DIR is set but empty");
+        }
+        return env;
+    }
+    return std::filesystem::temp_directory_path() / "arblang-cache";
+}
+
+// The identity of the host CPU: the model and feature lines of the first
+// processor in /proc/cpuinfo, which decide what -march=native targets.
+const std::string& host_cpu() {
+    static const std::string cpu = [] {
+        static const char* keys[] = {"vendor_id", "cpu family", "model", "model name", "stepping", "flags",
+                                     "CPU implementer", "CPU architecture", "CPU variant", "CPU part", "Features"};
+        std::ifstream in("/proc/cpuinfo");
+        std::string line, id;
+        while (std::getline(in, line) && !line.empty()) {
+            auto key = line.substr(0, line.find_first_of("\t:"));
+            if (std::find(std::begin(keys), std::end(keys), key) != std::end(keys)) {
+                id += line + "\n";
+            }
+        }
+        return id;
+    }();
+    return cpu;
+}
+
+// `s` as a single word of a POSIX shell command.
+std::string shell_quote(const std::string& s) {
+    std::string q = "'";
+    for (char c: s) {
+        q += c == '\''? std::string("'\\''"): std::string(1, c);
+    }
+    return q + "'";
+}
+
+std::string read_file(const std::filesystem::path& p) {
+    std::ifstream in(p);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+}
+
+native_kernel compile_native(const ir_ptr& program, const std::string& name, const native_options& opt) {
+    std::stringstream src;
+    auto emitter = simd_kernel(src, program, opt.width);
+    emitter.prelude();
+    emitter.kernel(name);
+
+    // Objects built for the host CPU are only valid on the same model of CPU.
+    auto key_text = opt.compiler + "\n" + opt.flags + "\n" + src.str();
+    if (opt.flags.find("=native") != std::string::npos) {
+        key_text += "\n" + host_cpu();
+    }
+    std::stringstream stem;
+    stem << "arb_" << std::hex << stable_hash(key_text);
+
+    auto dir = cache_directory(opt);
+    std::filesystem::create_directories(dir);
+    auto lib = dir / (stem.str() + ".so");
+
+    if (!std::filesystem::exists(lib)) {
+        // Every attempt builds under names of its own, made unique by mkstemps,
+        // and only the finished object is renamed into place, so concurrent
+        // compilations of one kernel never see each other's partial files.
+        auto pattern = (dir / (stem.str() + ".XXXXXX.cpp")).string();
+        int fd = mkstemps(pattern.data(), 4);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot compile kernel \"" + name + "\": cannot create a file in " + dir.string());
+        }
+        close(fd);
+        std::filesystem::path cpp = pattern;
+        auto log = std::filesystem::path(cpp).replace_extension(".log");
+        auto tmp = std::filesystem::path(cpp).replace_extension(".so.tmp");
+
+        std::ofstream(cpp) << src.str();
+
+        auto cmd = opt.compiler + " " + opt.flags + " -fPIC -shared -o " + shell_quote(tmp.string()) + " " + shell_quote(cpp.string())
+                 + " > " + shell_quote(log.string()) + " 2>&1";
+        bool ok = std::system(cmd.c_str()) == 0;
+        if (ok) {
+            std::filesystem::rename(tmp, lib);
+        }
+        // The source is removed last, as its name reserves the others.
+        auto messages = ok? std::string(): read_file(log);
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        std::filesystem::remove(log, ec);
+        std::filesystem::remove(cpp, ec);
+        if (!ok) {
+            throw std::runtime_error("Cannot compile kernel \"" + name + "\":\n" + messages);
+        }
+    }
+
+    auto handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        throw std::runtime_error("Cannot load kernel \"" + name + "\": " + dlerror());
+    }
+
+    native_kernel k;
+    k.precision_ = emitter.precision_;
+    k.library_ = std::shared_ptr<void>(handle, [](void* h) { dlclose(h); });
+    k.path_ = lib.string();
+    k.fn_ = dlsym(handle, simd_kernel::identifier(name).c_str());
+    if (!k.fn_) {
+        throw std::runtime_error("Cannot load kernel \"" + name + "\": symbol not found in " + k.path_);
+    }
+    return k;
+}
+
+} //namespace ir
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "ir_arblang.hpp"
+
+namespace ir {
+
+// Entry point of a compiled kernel, on float or double columns; see
+// simd_kernel for the column layout.
+template <typename T>
+using kernel_fn = void (*)(std::size_t n, const T* const* in, T* const* out);
+
+struct native_options {
+    std::string compiler  = "c++";
+    std::string flags     = "-std=c++17 -O3 -march=native -ffp-contract=off -fno-trapping-math";   // fuse only the IR's fma nodes; vectorize intrinsics
+    std::string cache_dir = "";   // defaults to $ARBLANG_CACHE_DIR, then <tmp>/arblang-cache
+    unsigned    width     = 4;    // SIMD width in doubles; f32 kernels have twice the lanes
+};
+
+// A kernel loaded from a shared object. The object stays loaded for as long
+// as any copy of the handle is alive.
+struct native_kernel {
+    void* fn_ = nullptr;
+    precision precision_ = precision::f64;
+    std::shared_ptr<void> library_;
+    std::string path_;
+
+    // T is float for an f32 kernel and double for an f64 one.
+    template <typename T>
+    void operator()(std::size_t n, const T* const* in, T* const* out) const {
+        if (precision_ != (sizeof(T) == sizeof(float)? precision::f32: precision::f64)) {
+            throw std::runtime_error("Cannot run native kernel: columns do not match the kernel's precision");
+        }
+        ((kernel_fn<T>)fn_)(n, in, out);
+    }
+};
+
+// Emits function `name` of `program` as C++, compiles it into a shared object
+// and loads it. Objects are cached by a hash of the source, compiler and flags,
+// and of the host CPU if the flags target it (-march=native), so an unchanged
+// kernel is only compiled once across runs.
+native_kernel compile_native(const ir_ptr& program, const std::string& name, const native_options& opt = {});
+
+} //namespace ir
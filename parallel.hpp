@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "arena.hpp"
+
+// Calls f(i) for every i in [0, n) on a pool of up to `num_threads` workers
+// (0: one per hardware thread) that take indices in order. Workers allocate
+// nodes from forks of the caller's current arena. The first exception thrown
+// by any call is rethrown once all workers have finished.
+template <typename F>
+void parallel_for(std::size_t n, unsigned num_threads, F&& f) {
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = std::min<std::size_t>(num_threads, n);
+
+    auto parent = arena::current();
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&](arena* a) {
+        arena* prev = arena::current();
+        arena::current() = a;
+        for (std::size_t i = next++; i < n; i = next++) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) error = std::current_exception();
+                next = n;
+            }
+        }
+        arena::current() = prev;
+    };
+
+    if (num_threads <= 1) {
+        work(parent);
+    } else {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < num_threads; ++t) {
+            workers.emplace_back(work, parent? &parent->fork(): nullptr);
+        }
+        for (auto& w: workers) {
+            w.join();
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+
+#include "parser.hpp"
+
+namespace core {
+
+namespace {
+
+struct token {
+    enum kind {
+        lparen,
+        rparen,
+        colon,
+        dot,
+        name,
+        number,
+        op,
+        invalid,
+        end
+    };
+
+    kind             kind_;
+    std::string_view text_;   // points into the source
+    source_location  loc_;
+};
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+bool is_name_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool is_name_char(char c) {
+    return is_name_start(c) || is_digit(c) || c == '-';
+}
+
+struct lexer {
+    std::string_view src_;
+    std::size_t pos_ = 0;
+    unsigned line_ = 1;
+    std::size_t line_start_ = 0;
+
+    lexer(std::string_view src) : src_(src) {}
+
+    token next() {
+        skip();
+        source_location loc = {line_, (unsigned)(pos_ - line_start_ + 1)};
+        if (pos_ == src_.size()) {
+            return {token::end, {}, loc};
+        }
+
+        auto start = pos_;
+        char c = src_[pos_];
+        auto single = [&](token::kind k) {
+            ++pos_;
+            return token{k, src_.substr(start, 1), loc};
+        };
+
+        switch (c) {
+            case '(': return single(token::lparen);
+            case ')': return single(token::rparen);
+            case ':': return single(token::colon);
+            case '.':
+                if (is_digit_at(pos_ + 1)) {
+                    return number(loc);
+                }
+                return single(token::dot);
+            case '*':
+            case '/': return single(token::op);
+            case '+':
+            case '-':
+                if (is_digit_at(pos_ + 1) || (pos_ + 1 < src_.size() && src_[pos_+1] == '.' && is_digit_at(pos_ + 2)) || special_at(pos_ + 1)) {
+                    return number(loc);
+                }
+                return single(token::op);
+            default:
+                break;
+        }
+        if (is_digit(c) || special_at(pos_)) {
+            return number(loc);
+        }
+        if (is_name_start(c)) {
+            while (pos_ < src_.size() && is_name_char(src_[pos_])) ++pos_;
+            return {token::name, src_.substr(start, pos_ - start), loc};
+        }
+        return single(token::invalid);
+    }
+
+private:
+    void skip() {
+        while (pos_ < src_.size()) {
+            char c = src_[pos_];
+            if (c == '\n') {
+                ++pos_;
+                ++line_;
+                line_start_ = pos_;
+            } else if (c == ' ' || c == '\t' || c == '\r') {
+                ++pos_;
+            } else if (c == ';') {
+                while (pos_ < src_.size() && src_[pos_] != '\n') ++pos_;
+            } else {
+                break;
+            }
+        }
+    }
+
+    bool is_digit_at(std::size_t i) const {
+        return i < src_.size() && is_digit(src_[i]);
+    }
+
+    // Whether the name starting at `i` is exactly "inf" or "nan".
+    bool special_at(std::size_t i) const {
+        auto word = src_.substr(std::min(i, src_.size()), 3);
+        return (word == "inf" || word == "nan") && (i + 3 == src_.size() || !is_name_char(src_[i + 3]));
+    }
+
+    // [+-] (digits [. digits] | . digits) [(e|E) [+-] digits] | [+-] (inf | nan)
+    token number(source_location loc) {
+        auto start = pos_;
+        auto digits = [&] {
+            while (pos_ < src_.size() && is_digit(src_[pos_])) ++pos_;
+        };
+        if (src_[pos_] == '+' || src_[pos_] == '-') ++pos_;
+        if (special_at(pos_)) {
+            pos_ += 3;
+            return {token::number, src_.substr(start, pos_ - start), loc};
+        }
+        digits();
+        if (pos_ < src_.size() && src_[pos_] == '.') {
+            ++pos_;
+            digits();
+        }
+        if (pos_ < src_.size() && (src_[pos_] == 'e' || src_[pos_] == 'E')) {
+            ++pos_;
+            if (pos_ < src_.size() && (src_[pos_] == '+' || src_[pos_] == '-')) ++pos_;
+            digits();
+        }
+        return {token::number, src_.substr(start, pos_ - start), loc};
+    }
+};
+
+struct parser {
+    lexer lex_;
+    const std::string& filename_;
+    token tok_;     // current token
+    token next_;    // the one after it
+
+    parser(std::string_view src, const std::string& filename) : lex_(src), filename_(filename) {
+        tok_  = lex_.next();
+        next_ = lex_.next();
+    }
+
+    std::shared_ptr<block_expr> program() {
+        std::vector<expr_ptr> statements;
+        while (tok_.kind_ != token::end) {
+            statements.push_back(statement());
+        }
+        auto b = make_node<block_expr>(statements);
+        b->loc_ = {1, 1};
+        return b;
+    }
+
+private:
+    [[noreturn]] void error(const source_location& loc, const std::string& msg) {
+        throw std::runtime_error(filename_ + ":" + std::to_string(loc.line) + ":" + std::to_string(loc.column) + ": " + msg);
+    }
+
+    [[noreturn]] void unexpected(const std::string& what) {
+        if (tok_.kind_ == token::end) {
+            error(tok_.loc_, "expected " + what + ", found end of input");
+        }
+        error(tok_.loc_, "expected " + what + ", found \"" + std::string(tok_.text_) + "\"");
+    }
+
+    token advance() {
+        auto t = tok_;
+        tok_  = next_;
+        next_ = lex_.next();
+        return t;
+    }
+
+    token expect(token::kind k, const char* what) {
+        if (tok_.kind_ != k) {
+            unexpected(what);
+        }
+        return advance();
+    }
+
+    static bool is_keyword(const token& t, std::string_view k) {
+        return t.kind_ == token::name && t.text_ == k;
+    }
+
+    void expect_keyword(std::string_view k) {
+        if (!is_keyword(tok_, k)) {
+            unexpected("\"" + std::string(k) + "\"");
+        }
+        advance();
+    }
+
+    expr_ptr statement() {
+        auto open = expect(token::lparen, "'('");
+        if (is_keyword(tok_, "let_s")) {
+            advance();
+            expect(token::lparen, "'('");
+            auto name = expect(token::name, "a struct name");
+            std::vector<source_location> locs;
+            auto fields = vardefs(locs);
+            expect(token::rparen, "')'");
+            expect(token::rparen, "')'");
+
+            auto s = make_node<struct_expr>(std::string(name.text_), fields);
+            s->loc_ = open.loc_;
+            locate(s->fields_, locs);
+            return s;
+        }
+
+        auto ret = expect(token::name, "\"let_s\" or a return type");
+        expect_keyword("let_f");
+        expect(token::lparen, "'('");
+        auto name = expect(token::name, "a function name");
+        std::vector<source_location> locs;
+        auto args = vardefs(locs);
+        auto body = expression();
+        expect(token::rparen, "')'");
+        expect(token::rparen, "')'");
+
+        auto f = make_node<func_expr>(std::string(ret.text_), std::string(name.text_), args, body);
+        f->loc_ = open.loc_;
+        locate(f->args_, locs);
+        return f;
+    }
+
+    // '(' (name:type)* ')'
+    std::vector<typed_var> vardefs(std::vector<source_location>& locs) {
+        std::vector<typed_var> vars;
+        expect(token::lparen, "'('");
+        while (tok_.kind_ != token::rparen) {
+            locs.push_back(tok_.loc_);
+            vars.push_back(vardef());
+        }
+        advance();
+        return vars;
+    }
+
+    typed_var vardef() {
+        auto var = expect(token::name, "a variable name");
+        expect(token::colon, "':'");
+        auto type = expect(token::name, "a type name");
+        return {std::string(var.text_), std::string(type.text_)};
+    }
+
+    static void locate(std::vector<expr_ptr>& vars, const std::vector<source_location>& locs) {
+        for (unsigned i = 0; i < vars.size(); ++i) {
+            vars[i]->loc_ = locs[i];
+        }
+    }
+
+    expr_ptr expression() {
+        auto loc = tok_.loc_;
+        expr_ptr e;
+        switch (tok_.kind_) {
+            case token::number: {
+                auto t = advance();
+                double val = 0;
+                auto text = t.text_.front() == '+'? t.text_.substr(1): t.text_;
+                auto r = std::from_chars(text.data(), text.data() + text.size(), val);
+                if (r.ec != std::errc() || r.ptr != text.data() + text.size()) {
+                    error(loc, "invalid number \"" + std::string(t.text_) + "\"");
+                }
+                e = make_node<float_expr>(val);
+                break;
+            }
+            case token::name: {
+                auto var = advance();
+                if (tok_.kind_ == token::dot) {
+                    advance();
+                    auto field = expect(token::name, "a field name");
+                    e = make_node<access_expr>(std::string(var.text_), std::string(field.text_));
+                } else {
+                    e = make_node<varref_expr>(std::string(var.text_));
+                }
+                break;
+            }
+            case token::lparen: {
+                if (is_keyword(next_, "let")) {
+                    return let_chain();
+                }
+                advance();
+                if (tok_.kind_ == token::op) {
+                    auto op = advance();
+                    auto lhs = expression();
+                    auto rhs = expression();
+                    e = make_node<binary_expr>(lhs, rhs, operation_of(op.text_.front()));
+                } else if (is_keyword(tok_, "create")) {
+                    advance();
+                    auto name = expect(token::name, "a struct name");
+                    e = make_node<create_expr>(std::string(name.text_), list());
+                } else if (is_keyword(tok_, "apply")) {
+                    advance();
+                    auto name = expect(token::name, "a function name");
+                    e = make_node<apply_expr>(std::string(name.text_), list());
+                } else {
+                    unexpected("an operator, \"let\", \"create\" or \"apply\"");
+                }
+                expect(token::rparen, "')'");
+                break;
+            }
+            default:
+                unexpected("an expression");
+        }
+        e->loc_ = loc;
+        return e;
+    }
+
+    // A let whose body is another let is parsed in the same loop, so long
+    // chains do not recurse.
+    expr_ptr let_chain() {
+        struct binding {
+            source_location loc, var_loc;
+            typed_var       var;
+            expr_ptr        val;
+        };
+        std::vector<binding> lets;
+
+        do {
+            auto open = advance();
+            advance();
+            expect(token::lparen, "'('");
+            auto var_loc = tok_.loc_;
+            auto var = vardef();
+            expect(token::lparen, "'('");
+            auto val = expression();
+            expect(token::rparen, "')'");
+            expect(token::rparen, "')'");
+            expect_keyword("in");
+            lets.push_back({open.loc_, var_loc, var, val});
+        } while (tok_.kind_ == token::lparen && is_keyword(next_, "let"));
+
+        auto body = expression();
+        for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+            expect(token::rparen, "')'");
+            auto l = make_node<let_expr>(it->var, it->val, body);
+            l->loc_ = it->loc;
+            l->var_->loc_ = it->var_loc;
+            body = l;
+        }
+        return body;
+    }
+
+    // '(' expr* ')'
+    std::vector<expr_ptr> list() {
+        std::vector<expr_ptr> es;
+        expect(token::lparen, "'('");
+        while (tok_.kind_ != token::rparen) {
+            es.push_back(expression());
+        }
+        advance();
+        return es;
+    }
+
+    static operation operation_of(char c) {
+        switch (c) {
+            case '+': return operation::add;
+            case '-': return operation::sub;
+            case '*': return operation::mul;
+            default:  return operation::div;
+        }
+    }
+};
+
+} // namespace
+
+std::shared_ptr<block_expr> parse(std::string_view source, const std::string& filename) {
+    return parser(source, filename).program();
+}
+
+std::shared_ptr<block_expr> parse_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open file \"" + path + "\"");
+    }
+    // Read in chunks rather than seeking for the size, which fails on pipes.
+    std::string source;
+    char buf[1 << 16];
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+        source.append(buf, in.gcount());
+    }
+    if (in.bad()) {
+        throw std::runtime_error("Cannot read file \"" + path + "\"");
+    }
+    return parse(source, path);
+}
+
+} //namespace core
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "core_arblang.hpp"
+
+namespace core {
+
+// Parses a program written in the syntax of core::print:
+//
+//   (let_s (name (field:type ...)))
+//   (ret let_f (name (arg:type ...) expr))
+//
+//   expr := number | var | var.field            number may be .5, 1e-3, inf, -inf, nan
+//         | (let (var:type (expr)) in expr)
+//         | (op expr expr)                     op is one of + - * /
+//         | (create name(expr ...))
+//         | (apply name(expr ...))             name may be an intrinsic: exp, log, pow, exprelr
+//
+// The names inf and nan are literals, not variables.
+// `;` starts a comment that runs to the end of the line. Every node records
+// its source location; errors are reported as runtime_errors prefixed with
+// "filename:line:column:". Nodes are allocated with make_node.
+std::shared_ptr<block_expr> parse(std::string_view source, const std::string& filename = "<input>");
+
+std::shared_ptr<block_expr> parse_file(const std::string& path);
+
+} //namespace core
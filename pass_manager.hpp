@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+
+#include "transform.hpp"
+
+struct pass_stats {
+    std::string name;
+    double      seconds;
+    std::size_t nodes_before, nodes_after;
+    std::size_t bytes_before, bytes_after;   // arena bytes allocated
+};
+
+// Runs a configurable sequence of passes over a program and records, for every
+// pass, its wall time, the IR node count and the arena bytes allocated before
+// and after. Validation and tracing are optional and are not timed.
+struct pass_manager {
+    using pass_fn = std::function<void(ir::ir_ptr)>;
+
+    struct pass {
+        std::string name;
+        pass_fn     run;
+    };
+
+    std::vector<pass>       pipeline_;
+    std::vector<pass_stats> stats_;
+    bool          validate_ = false;
+    std::ostream* trace_    = nullptr;   // print the IR after every pass
+
+    pass_manager& add(std::string name, pass_fn f) {
+        pipeline_.push_back({std::move(name), std::move(f)});
+        return *this;
+    }
+
+    pass_manager& add(const std::string& name) {
+        return add(name, known(name));
+    }
+
+    // Adds the passes of a comma-separated list of names, e.g. "cp,dce,cse,dce".
+    pass_manager& parse(const std::string& pipeline) {
+        std::stringstream ss(pipeline);
+        std::string name;
+        while (std::getline(ss, name, ',')) {
+            if (!name.empty()) add(name);
+        }
+        return *this;
+    }
+
+    static pass_fn known(const std::string& name) {
+        if (name == "cp"  || name == "constant_prop") return constant_propagate;
+        if (name == "dce" || name == "dead_code")     return elim_dead_code;
+        if (name == "cse")                            return elim_common_subexpressions;
+        if (name == "inline")                         return inline_functions;
+        if (name == "sroa")                           return scalar_replace;
+        if (name == "simplify")                       return simplify_algebra;
+        if (name == "simplify_fast")                  return simplify_fast_math;
+        if (name == "contract")                       return contract_fused;
+        throw std::runtime_error("Unknown pass \"" + name + "\"");
+    }
+
+    void run(ir::ir_ptr nested) {
+        auto valid = ir::validate();
+        for (auto& p: pipeline_) {
+            pass_stats s;
+            s.name = p.name;
+            s.nodes_before = count(nested);
+            s.bytes_before = allocated();
+
+            auto t0 = std::chrono::steady_clock::now();
+            p.run(nested);
+            auto t1 = std::chrono::steady_clock::now();
+
+            s.seconds = std::chrono::duration<double>(t1 - t0).count();
+            s.bytes_after = allocated();
+            s.nodes_after = count(nested);
+            stats_.push_back(s);
+
+            if (validate_) {
+                nested->accept(valid);
+            }
+            if (trace_) {
+                auto printer = ir::print(*trace_);
+                *trace_ << "\n------------------------------------------------------\n";
+                nested->accept(printer);
+            }
+        }
+    }
+
+    // Writes the statistics of every pass run so far as JSON.
+    void report(std::ostream& o) const {
+        o << "[\n";
+        for (unsigned i = 0; i < stats_.size(); ++i) {
+            auto& s = stats_[i];
+            o << "  {\"pass\": \"" << s.name << "\""
+              << ", \"seconds\": " << s.seconds
+              << ", \"nodes_before\": " << s.nodes_before
+              << ", \"nodes_after\": " << s.nodes_after
+              << ", \"bytes_before\": " << s.bytes_before
+              << ", \"bytes_after\": " << s.bytes_after
+              << "}" << (i+1 < stats_.size()? ",": "") << "\n";
+        }
+        o << "]\n";
+    }
+
+private:
+    static std::size_t count(const ir::ir_ptr& nested) {
+        auto counter = ir::node_count();
+        nested->accept(counter);
+        return counter.count_;
+    }
+
+    static std::size_t allocated() {
+        auto a = arena::current();
+        return a? a->bytes_allocated(): 0;
+    }
+};
@@ -0,0 +1,429 @@
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "serialize.hpp"
+
+namespace ir {
+
+namespace {
+
+const char          file_magic[8]   = {'A', 'R', 'B', 'L', 'A', 'N', 'G', '\0'};
+const std::uint32_t file_byte_order = 0x01020304;
+const std::uint32_t no_type         = 0xffffffff;
+
+enum file_type_kind : std::uint32_t {
+    float_kind,
+    struct_kind,
+    func_kind
+};
+
+struct file_header {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t num_strings, string_bytes;
+    std::uint32_t num_types, num_fields;
+    std::uint32_t num_defs, num_instructions;
+    std::uint32_t num_operands, float_bits;   // float_bits: 32 or 64, the precision of the float type
+};
+
+struct file_type {
+    std::uint32_t kind, name, ret;
+    std::uint32_t first_field, num_fields;
+};
+
+struct file_field {
+    std::uint32_t name, type;
+};
+
+struct file_definition {
+    std::uint32_t name, type, num_args, result;
+    std::uint32_t first_code, num_code;
+    std::uint32_t first_operand, num_operands;
+};
+
+struct file_instruction {
+    std::uint8_t  kind, op;
+    std::uint16_t flags;
+    std::uint32_t type, name;
+    std::uint32_t lhs, rhs, aux;
+    double        val;
+};
+
+static_assert(sizeof(file_header) == 48 && sizeof(file_instruction) == 32, "unexpected padding in file records");
+
+std::size_t align8(std::size_t n) {
+    return (n + 7) & ~(std::size_t)7;
+}
+
+struct writer {
+    const ssa_program& program_;
+
+    std::unordered_map<symbol, std::uint32_t> strings_;
+    std::vector<symbol> string_list_;
+    std::unordered_map<const typeobj*, std::uint32_t> types_;
+    std::vector<file_type>  file_types_;
+    std::vector<file_field> file_fields_;
+    std::uint32_t float_bits_ = 0;  // of the program's float type; 0 if it has none
+
+    writer(const ssa_program& program) : program_(program) {}
+
+    std::string write() {
+        std::vector<std::uint32_t> type_index;
+        for (auto& t: program_.types_) {
+            type_index.push_back(type(t));
+        }
+
+        std::vector<file_definition>  defs;
+        std::vector<file_instruction> code;
+        std::vector<std::uint32_t>    operands;
+        for (auto& d: program_.defs_) {
+            defs.push_back({string(d.name_), type_index[d.type_], d.num_args_, d.result_,
+                            (std::uint32_t)code.size(), (std::uint32_t)d.code_.size(),
+                            (std::uint32_t)operands.size(), (std::uint32_t)d.operands_.size()});
+            for (auto& c: d.code_) {
+                code.push_back({(std::uint8_t)c.kind_, (std::uint8_t)c.op_, c.flags_, type_index[c.type_], string(c.name_), c.lhs_, c.rhs_, c.aux_, c.val_});
+            }
+            operands.insert(operands.end(), d.operands_.begin(), d.operands_.end());
+        }
+
+        std::vector<std::uint32_t> offsets = {0};
+        std::string chars;
+        for (auto s: string_list_) {
+            chars += s.str();
+            offsets.push_back(chars.size());
+        }
+
+        file_header h = {};
+        std::memcpy(h.magic, file_magic, sizeof(file_magic));
+        h.version          = ir_format_version;
+        h.byte_order       = file_byte_order;
+        h.num_strings      = string_list_.size();
+        h.string_bytes     = chars.size();
+        h.num_types        = file_types_.size();
+        h.num_fields       = file_fields_.size();
+        h.num_defs         = defs.size();
+        h.num_instructions = code.size();
+        h.num_operands     = operands.size();
+        h.float_bits       = float_bits_;
+
+        std::string out;
+        put(out, &h, 1);
+        put(out, offsets.data(), offsets.size());
+        put(out, chars.data(), chars.size());
+        put(out, file_types_.data(), file_types_.size());
+        put(out, file_fields_.data(), file_fields_.size());
+        put(out, defs.data(), defs.size());
+        put(out, code.data(), code.size());
+        put(out, operands.data(), operands.size());
+        return out;
+    }
+
+private:
+    template <typename T>
+    static void put(std::string& out, const T* p, std::size_t n) {
+        out.append((const char*)p, n*sizeof(T));
+        out.resize(align8(out.size()), '\0');
+    }
+
+    std::uint32_t string(symbol s) {
+        auto it = strings_.find(s);
+        if (it == strings_.end()) {
+            it = strings_.insert({s, (std::uint32_t)string_list_.size()}).first;
+            string_list_.push_back(s);
+        }
+        return it->second;
+    }
+
+    // Writes the components of `t` before `t` itself.
+    std::uint32_t type(const type_ptr& t) {
+        auto it = types_.find(t.get());
+        if (it != types_.end()) {
+            return it->second;
+        }
+
+        file_type ft = {float_kind, string(t->name()), no_type, 0, 0};
+        const std::vector<field>* fields = nullptr;
+        if (auto f = t->is_float()) {
+            std::uint32_t bits = f->precision_ == precision::f32? 32: 64;
+            if (float_bits_ && float_bits_ != bits) {
+                throw std::runtime_error("Cannot save IR: the program mixes float precisions");
+            }
+            float_bits_ = bits;
+        } else if (auto s = t->is_struct()) {
+            ft.kind = struct_kind;
+            fields = &s->fields_;
+        } else if (auto f = t->is_func()) {
+            ft.kind = func_kind;
+            ft.ret = type(f->ret_);
+            fields = &f->args_;
+        }
+
+        std::vector<file_field> ffs;
+        if (fields) {
+            for (auto& f: *fields) {
+                ffs.push_back({string(f.name), type(f.type)});
+            }
+        }
+        ft.first_field = file_fields_.size();
+        ft.num_fields = ffs.size();
+        file_fields_.insert(file_fields_.end(), ffs.begin(), ffs.end());
+
+        types_[t.get()] = file_types_.size();
+        file_types_.push_back(ft);
+        return file_types_.size() - 1;
+    }
+};
+
+struct reader {
+    const char* data_;
+    std::size_t size_;
+    std::size_t pos_ = 0;
+
+    reader(const char* data, std::size_t size) : data_(data), size_(size) {}
+
+    ssa_program read() {
+        auto& h = *take<file_header>(1);
+        if (std::memcmp(h.magic, file_magic, sizeof(file_magic)) != 0) {
+            error("not an IR file");
+        }
+        if (h.byte_order != file_byte_order) {
+            error("written on a machine with a different byte order");
+        }
+        if (h.version != ir_format_version) {
+            error("format version " + std::to_string(h.version) + ", expected " + std::to_string(ir_format_version));
+        }
+        // Types are interned into the current context, so its floats must match the file's.
+        auto bits = type_context::current().float_precision() == precision::f32? 32u: 64u;
+        if (h.float_bits != 0 && h.float_bits != bits) {
+            error("written for " + std::to_string(h.float_bits) + "-bit floats, but the type context uses " + std::to_string(bits) + "-bit floats");
+        }
+
+        auto offsets  = take<std::uint32_t>(h.num_strings + (std::size_t)1);
+        auto chars    = take<char>(h.string_bytes);
+        auto types    = take<file_type>(h.num_types);
+        auto fields   = take<file_field>(h.num_fields);
+        auto defs     = take<file_definition>(h.num_defs);
+        auto code     = take<file_instruction>(h.num_instructions);
+        auto operands = take<std::uint32_t>(h.num_operands);
+
+        std::vector<symbol> strings;
+        for (std::uint32_t i = 0; i < h.num_strings; ++i) {
+            if (offsets[i] > offsets[i+1] || offsets[i+1] > h.string_bytes) {
+                error("string table out of bounds");
+            }
+            strings.push_back(std::string(chars + offsets[i], offsets[i+1] - offsets[i]));
+        }
+        auto str = [&](std::uint32_t i) {
+            check(i < strings.size(), "string index out of bounds");
+            return strings[i];
+        };
+
+        ssa_program p;
+        auto& context = type_context::current();
+        for (std::uint32_t i = 0; i < h.num_types; ++i) {
+            auto& t = types[i];
+            check((std::uint64_t)t.first_field + t.num_fields <= h.num_fields, "type fields out of bounds");
+            std::vector<field> fs;
+            for (auto j = t.first_field; j < t.first_field + t.num_fields; ++j) {
+                check(fields[j].type < i, "type defined before its components");
+                fs.push_back({str(fields[j].name), p.types_[fields[j].type]});
+            }
+            switch (t.kind) {
+                case float_kind:
+                    check(fs.empty(), "float type with fields");
+                    p.types_.push_back(context.get_float());
+                    break;
+                case struct_kind:
+                    p.types_.push_back(context.get_struct(str(t.name), fs));
+                    break;
+                case func_kind:
+                    check(t.ret < i, "type defined before its components");
+                    p.types_.push_back(context.get_func(str(t.name), p.types_[t.ret], fs));
+                    break;
+                default:
+                    error("unknown type kind");
+            }
+        }
+
+        for (std::uint32_t i = 0; i < h.num_defs; ++i) {
+            auto& fd = defs[i];
+            check(fd.type < h.num_types, "type index out of bounds");
+            check((std::uint64_t)fd.first_code + fd.num_code <= h.num_instructions, "definition code out of bounds");
+            check((std::uint64_t)fd.first_operand + fd.num_operands <= h.num_operands, "definition operands out of bounds");
+
+            p.defs_.emplace_back();
+            auto& d = p.defs_.back();
+            d.name_ = str(fd.name);
+            d.type_ = fd.type;
+            d.num_args_ = fd.num_args;
+            d.result_ = fd.result;
+            d.operands_.assign(operands + fd.first_operand, operands + fd.first_operand + fd.num_operands);
+
+            if (p.types_[d.type_]->is_struct()) {
+                check(fd.num_code == 0, "struct definition with code");
+                continue;
+            }
+            auto func = p.types_[d.type_]->is_func();
+            check(func && fd.num_code > 0, "function definition without code");
+            check(fd.num_args == func->args_.size(), "argument count does not match the function type");
+            check(fd.num_args <= fd.num_code && fd.result < fd.num_code, "function result out of bounds");
+
+            auto type_of = [&](std::uint32_t o) {return p.types_[d.code_[o].type_];};
+
+            d.code_.reserve(fd.num_code);
+            for (std::uint32_t j = 0; j < fd.num_code; ++j) {
+                auto& fc = code[fd.first_code + j];
+                check(fc.kind <= (std::uint8_t)ssa_op::intrinsic && fc.op <= operation::div, "unknown instruction");
+                check(fc.flags <= (fma_negate_product | fma_negate_addend), "unknown instruction flags");
+                check(fc.type < h.num_types, "type index out of bounds");
+
+                ssa_instruction c = {(ssa_op)fc.kind, (operation)fc.op, fc.type, str(fc.name), fc.lhs, fc.rhs, fc.aux, fc.val, (std::uint8_t)fc.flags};
+                check((c.kind_ == ssa_op::arg) == (j < fd.num_args), "argument instruction out of place");
+                if (c.kind_ == ssa_op::apply) {
+                    check(c.aux_ < i && p.defs_[c.aux_].is_func(), "call to a function not defined before");
+                }
+                if (c.kind_ == ssa_op::intrinsic) {
+                    check(c.aux_ < num_intrinsics && c.rhs_ == intrinsic_arity((intrinsic)c.aux_), "unknown intrinsic");
+                }
+                if (c.kind_ == ssa_op::create || c.kind_ == ssa_op::apply || c.kind_ == ssa_op::intrinsic) {
+                    check((std::uint64_t)c.lhs_ + c.rhs_ <= fd.num_operands, "operand list out of bounds");
+                }
+                for_each_operand(d, c, [&](std::uint32_t o) {
+                    check(o < j, "operand is not an earlier instruction");
+                });
+
+                // Every value has the type its operation produces from its operands.
+                auto& t = p.types_[c.type_];
+                auto list = [&](const std::vector<field>& fs, const char* msg) {
+                    check(c.rhs_ == fs.size(), msg);
+                    for (std::uint32_t k = 0; k < c.rhs_; ++k) {
+                        check(type_of(d.operands_[c.lhs_ + k]) == fs[k].type, msg);
+                    }
+                };
+                switch (c.kind_) {
+                    case ssa_op::arg:
+                        check(t == func->args_[j].type, "argument type does not match the function type");
+                        break;
+                    case ssa_op::constant:
+                        check(t->is_float(), "constant of a non-float type");
+                        break;
+                    case ssa_op::copy:
+                        check(t == type_of(c.lhs_), "copy changes the type of its value");
+                        break;
+                    case ssa_op::access: {
+                        auto s = type_of(c.lhs_)->is_struct();
+                        check(s && c.rhs_ < s->fields_.size(), "access to a field that does not exist");
+                        check(t == s->fields_[c.rhs_].type, "access result does not match the field type");
+                        break;
+                    }
+                    case ssa_op::create: {
+                        auto s = t->is_struct();
+                        check(s, "create of a non-struct type");
+                        list(s->fields_, "create fields do not match the struct");
+                        break;
+                    }
+                    case ssa_op::apply: {
+                        auto callee = p.types_[p.defs_[c.aux_].type_]->is_func();
+                        check(t == callee->ret_, "call result does not match the callee's return type");
+                        list(callee->args_, "call arguments do not match the callee's signature");
+                        break;
+                    }
+                    default:
+                        check(t->is_float(), "arithmetic with a non-float result");
+                        for_each_operand(d, c, [&](std::uint32_t o) {
+                            check(type_of(o)->is_float(), "arithmetic on a non-float operand");
+                        });
+                }
+                d.code_.push_back(c);
+            }
+            check(type_of(d.result_) == func->ret_, "function result does not match the return type");
+        }
+        return p;
+    }
+
+private:
+    [[noreturn]] static void error(const std::string& msg) {
+        throw std::runtime_error("Cannot load IR: " + msg);
+    }
+
+    static void check(bool ok, const char* msg) {
+        if (!ok) error(msg);
+    }
+
+    template <typename T>
+    const T* take(std::size_t n) {
+        auto bytes = n*sizeof(T);
+        if (bytes > size_ - pos_) {
+            error("file is truncated");
+        }
+        auto p = (const T*)(data_ + pos_);
+        pos_ = std::min(size_, align8(pos_ + bytes));
+        return p;
+    }
+};
+
+} // namespace
+
+std::string serialize(const ssa_program& program) {
+    return writer(program).write();
+}
+
+ssa_program deserialize(const char* data, std::size_t size) {
+    if ((std::uintptr_t)data % 8) {
+        throw std::runtime_error("Cannot load IR: data is not 8-byte aligned");
+    }
+    return reader(data, size).read();
+}
+
+void save_program(const ir_ptr& program, const std::string& path) {
+    auto data = serialize(to_ssa(program));
+
+    // Write under a name private to this call and rename, so readers never
+    // see a partial file.
+    static std::atomic<unsigned> next_tmp{0};
+    auto tmp = path + "." + std::to_string(getpid()) + "." + std::to_string(next_tmp++) + ".tmp";
+    std::ofstream out(tmp, std::ios::binary);
+    out.write(data.data(), data.size());
+    out.close();
+    std::error_code ec, ignored;
+    if (out.fail()) {
+        std::filesystem::remove(tmp, ignored);
+        throw std::runtime_error("Cannot write IR to \"" + path + "\"");
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ignored);
+        throw std::runtime_error("Cannot write IR to \"" + path + "\": " + ec.message());
+    }
+}
+
+ir_ptr load_program(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open IR file \"" + path + "\"");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Cannot load IR: \"" + path + "\" is empty");
+    }
+    auto size = (std::size_t)st.st_size;
+    auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Cannot map IR file \"" + path + "\"");
+    }
+    std::shared_ptr<void> mapping(data, [size](void* p) { munmap(p, size); });
+
+    return from_ssa(deserialize((const char*)data, size));
+}
+
+} //namespace ir
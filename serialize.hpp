@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "ssa.hpp"
+
+namespace ir {
+
+// Binary form of an ssa_program, for reloading optimized IR without running
+// the front end or the passes again. The file is a fixed header followed by
+// arrays of fixed-size records in native byte order (checked on load), each
+// section 8-byte aligned:
+//
+//   header        magic "ARBLANG\0", format version, byte order mark, section sizes,
+//                 float precision (0 if the program has no floats)
+//   strings       offsets[num_strings+1], then the characters
+//   types         {kind, name, ret, first field, field count}; components precede their users
+//   fields        {name, type}
+//   definitions   {name, type, num args, result, first instruction, count, first operand, count}
+//   instructions  {kind, op, flags, type, name, lhs, rhs, aux, val}
+//   operands      create, apply and intrinsic operand lists
+//
+// Strings and types are written once and re-interned on load; the other
+// arrays are copied straight out of a memory-mapped file, with no per-node
+// parsing. A file written by a different format version, or for a float
+// precision other than that of the current type context, is rejected.
+const std::uint32_t ir_format_version = 4;
+
+std::string serialize(const ssa_program& program);
+
+// `data` must be 8-byte aligned. Indices, operand counts and types are
+// checked, so a corrupt file raises a runtime_error instead of producing a
+// malformed program.
+ssa_program deserialize(const char* data, std::size_t size);
+
+void save_program(const ir_ptr& program, const std::string& path);
+
+ir_ptr load_program(const std::string& path);
+
+} //namespace ir
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+
+#include "ir_arblang.hpp"
+
+namespace ir {
+
+// Flat form of a canonical program. A function body is one array of SSA
+// instructions in evaluation order; operands are indices of earlier
+// instructions of the same function, so passes and backends can walk it
+// with a loop instead of recursing down let scopes.
+enum class ssa_op : std::uint8_t {
+    arg,        // function argument
+    constant,   // val_
+    copy,       // lhs_
+    binary,     // lhs_ op_ rhs_
+    fma,        // lhs_*rhs_ + aux_, rounded once, with the signs in flags_
+    access,     // field rhs_ of lhs_
+    create,     // fields operands_[lhs_, lhs_+rhs_)
+    apply,      // definition aux_ applied to operands_[lhs_, lhs_+rhs_)
+    intrinsic,  // intrinsic aux_ applied to operands_[lhs_, lhs_+rhs_)
+};
+
+struct ssa_instruction {
+    ssa_op        kind_;
+    operation     op_   = operation::add;
+    std::uint32_t type_ = 0;    // index into ssa_program::types_
+    symbol        name_;        // variable bound to the value; empty for literal operands
+    std::uint32_t lhs_  = 0;
+    std::uint32_t rhs_  = 0;
+    std::uint32_t aux_  = 0;
+    double        val_  = 0;
+    std::uint8_t  flags_ = 0;   // fma_negate_product | fma_negate_addend
+};
+
+const std::uint8_t fma_negate_product = 1;
+const std::uint8_t fma_negate_addend  = 2;
+
+// A struct or function definition; structs have no code.
+struct ssa_definition {
+    symbol        name_;
+    std::uint32_t type_ = 0;        // index into ssa_program::types_
+    std::uint32_t num_args_ = 0;    // code_[0, num_args_) are the arguments
+    std::uint32_t result_ = 0;      // instruction holding the return value
+    std::vector<ssa_instruction> code_;
+    std::vector<std::uint32_t>   operands_;
+
+    bool is_func() const {
+        return !code_.empty();
+    }
+};
+
+struct ssa_program {
+    std::vector<type_ptr>       types_;
+    std::vector<ssa_definition> defs_;      // in program order
+};
+
+// Calls f(i) for every instruction index i used as an operand by `c`.
+template <typename F>
+void for_each_operand(const ssa_definition& d, const ssa_instruction& c, F&& f) {
+    switch (c.kind_) {
+        case ssa_op::arg:
+        case ssa_op::constant:
+            break;
+        case ssa_op::copy:
+        case ssa_op::access:
+            f(c.lhs_);
+            break;
+        case ssa_op::binary:
+            f(c.lhs_);
+            f(c.rhs_);
+            break;
+        case ssa_op::fma:
+            f(c.lhs_);
+            f(c.rhs_);
+            f(c.aux_);
+            break;
+        case ssa_op::create:
+        case ssa_op::apply:
+        case ssa_op::intrinsic:
+            for (auto i = c.lhs_; i < c.lhs_ + c.rhs_; ++i) {
+                f(d.operands_[i]);
+            }
+            break;
+    }
+}
+
+// Flattens a canonical nested program. Literal operands become unnamed
+// constants placed just before their user.
+struct ssa_builder {
+    ssa_program program_;
+
+    ssa_program build(const ir_ptr& program) {
+        program_ = {};
+        types_.clear();
+        funcs_.clear();
+
+        std::vector<ir_expression*> defs;
+        for (auto s = program.get(); s;) {
+            if (auto f = s->is_func()) {
+                funcs_[f->name_] = defs.size();
+                defs.push_back(f);
+                s = f->scope_.get();
+            } else if (auto t = s->is_struct()) {
+                defs.push_back(t);
+                s = t->scope_.get();
+            } else {
+                throw std::runtime_error("Cannot flatten program: expected a struct or function definition");
+            }
+        }
+
+        for (auto s: defs) {
+            program_.defs_.emplace_back();
+            auto& d = program_.defs_.back();
+            d.type_ = type(s->type());
+            if (auto t = s->is_struct()) {
+                d.name_ = t->name_;
+            } else {
+                function(*s->is_func(), d);
+            }
+        }
+        return std::move(program_);
+    }
+
+private:
+    std::unordered_map<const typeobj*, std::uint32_t> types_;
+    std::unordered_map<symbol, std::uint32_t> funcs_;
+    std::unordered_map<const ir_expression*, std::uint32_t> values_; // vardef -> instruction
+
+    std::uint32_t type(const type_ptr& t) {
+        auto it = types_.find(t.get());
+        if (it == types_.end()) {
+            it = types_.insert({t.get(), (std::uint32_t)program_.types_.size()}).first;
+            program_.types_.push_back(t);
+        }
+        return it->second;
+    }
+
+    void function(const func_rep& f, ssa_definition& d) {
+        values_.clear();
+        d.name_ = f.name_;
+        d.num_args_ = f.args_.size();
+
+        for (auto& a: f.args_) {
+            auto v = a->is_vardef();
+            values_[v] = d.code_.size();
+            d.code_.push_back({ssa_op::arg, operation::add, type(v->type()), v->name_, 0, 0, 0, 0, 0});
+        }
+
+        auto e = f.body_;
+        while (auto let = e->is_let()) {
+            auto v = let->var_->is_vardef();
+            auto i = value(let->val_, d);
+            auto& c = d.code_[i];
+            if (!c.name_.empty() || c.kind_ == ssa_op::arg) {
+                // `let x = y`
+                i = d.code_.size();
+                d.code_.push_back({ssa_op::copy, operation::add, type(v->type()), {}, operand(let->val_, d), 0, 0, 0, 0});
+            }
+            d.code_[i].name_ = v->name_;
+            values_[v] = i;
+            e = let->scope_;
+        }
+        d.result_ = operand(e, d);
+    }
+
+    // Appends the instruction computing canonical value `e`; returns its index.
+    // Varrefs resolve to their definition without emitting anything.
+    std::uint32_t value(const ir_ptr& e, ssa_definition& d) {
+        ssa_instruction c = {ssa_op::constant, operation::add, type(e->type()), {}, 0, 0, 0, 0, 0};
+        if (e->is_float() || e->is_varref()) {
+            return operand(e, d);
+        } else if (auto b = e->is_binary()) {
+            c.kind_ = ssa_op::binary;
+            c.op_  = b->op_;
+            c.lhs_ = operand(b->lhs_, d);
+            c.rhs_ = operand(b->rhs_, d);
+        } else if (auto m = e->is_fma()) {
+            c.kind_ = ssa_op::fma;
+            c.lhs_ = operand(m->lhs_, d);
+            c.rhs_ = operand(m->rhs_, d);
+            c.aux_ = operand(m->addend_, d);
+            c.flags_ = (m->negate_product_? fma_negate_product: 0) | (m->negate_addend_? fma_negate_addend: 0);
+        } else if (auto n = e->is_intrinsic()) {
+            c.kind_ = ssa_op::intrinsic;
+            c.aux_ = (std::uint32_t)n->fn_;
+            c.lhs_ = d.operands_.size();
+            c.rhs_ = list(n->args_, d);
+        } else if (auto a = e->is_access()) {
+            c.kind_ = ssa_op::access;
+            c.lhs_ = operand(a->var_, d);
+            c.rhs_ = a->index_;
+        } else if (auto s = e->is_create()) {
+            c.kind_ = ssa_op::create;
+            c.lhs_ = d.operands_.size();
+            c.rhs_ = list(s->fields_, d);
+        } else if (auto a = e->is_apply()) {
+            auto it = funcs_.find(a->func_->is_func()->name_);
+            if (it == funcs_.end()) {
+                throw std::runtime_error("Cannot flatten program: call to undefined function " + a->func_->is_func()->name_.str());
+            }
+            c.kind_ = ssa_op::apply;
+            c.aux_ = it->second;
+            c.lhs_ = d.operands_.size();
+            c.rhs_ = list(a->args_, d);
+        } else {
+            throw std::runtime_error("Cannot flatten program: function body is not in canonical form");
+        }
+        d.code_.push_back(c);
+        return d.code_.size() - 1;
+    }
+
+    std::uint32_t list(const std::vector<ir_ptr>& es, ssa_definition& d) {
+        // Resolve first: literals append instructions, not operands.
+        std::vector<std::uint32_t> ops;
+        for (auto& e: es) {
+            ops.push_back(operand(e, d));
+        }
+        d.operands_.insert(d.operands_.end(), ops.begin(), ops.end());
+        return ops.size();
+    }
+
+    std::uint32_t operand(const ir_ptr& e, ssa_definition& d) {
+        if (auto f = e->is_float()) {
+            d.code_.push_back({ssa_op::constant, operation::add, type(f->type()), {}, 0, 0, 0, f->val_, 0});
+            return d.code_.size() - 1;
+        }
+        if (auto r = e->is_varref()) {
+            auto it = values_.find(r->def_.get());
+            if (it == values_.end()) {
+                throw std::runtime_error("Cannot flatten program: reference to unbound variable " + r->def_->is_vardef()->name_.str());
+            }
+            return it->second;
+        }
+        throw std::runtime_error("Cannot flatten program: function body is not in canonical form");
+    }
+};
+
+// Rebuilds the nested program; the inverse of ssa_builder.
+struct ssa_lowering {
+    const ssa_program& program_;
+
+    ssa_lowering(const ssa_program& program) : program_(program) {}
+
+    ir_ptr lower() {
+        auto& defs = defs_;
+        defs.clear();
+        for (auto& d: program_.defs_) {
+            auto& t = program_.types_[d.type_];
+            if (auto s = t->is_struct()) {
+                std::vector<ir_ptr> fields;
+                for (auto& f: s->fields_) {
+                    fields.push_back(make_node<vardef_rep>(f.name, f.type));
+                }
+                defs.push_back(make_node<struct_rep>(d.name_, fields));
+            } else {
+                defs.push_back(function(d));
+            }
+        }
+
+        for (unsigned i = 0; i + 1 < defs.size(); ++i) {
+            if (auto f = defs[i]->is_func()) {
+                f->set_scope(defs[i+1]);
+            } else {
+                defs[i]->is_struct()->set_scope(defs[i+1]);
+            }
+        }
+        return defs.empty()? nullptr: defs.front();
+    }
+
+private:
+    std::vector<ir_ptr> defs_;   // definitions lowered so far, in order
+    std::vector<ir_ptr> vars_;   // instruction -> vardef; null for literal operands
+
+    ir_ptr function(const ssa_definition& d) {
+        auto& code = d.code_;
+        vars_.assign(code.size(), nullptr);
+
+        std::vector<ir_ptr> args, lets;
+        for (std::uint32_t i = 0; i < code.size(); ++i) {
+            auto& c = code[i];
+            if (c.name_.empty()) {
+                continue;
+            }
+            vars_[i] = make_node<vardef_rep>(c.name_, program_.types_[c.type_]);
+            if (c.kind_ == ssa_op::arg) {
+                args.push_back(vars_[i]);
+            } else {
+                lets.push_back(make_node<let_rep>(vars_[i], value(d, c)));
+            }
+        }
+
+        auto result = operand(d, d.result_);
+        for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+            auto let = (*it)->is_let();
+            let->set_scope(result);
+            let->set_type(result->type());
+            result = *it;
+        }
+        return make_node<func_rep>(d.name_, args, result, program_.types_[d.type_]);
+    }
+
+    ir_ptr value(const ssa_definition& d, const ssa_instruction& c) {
+        auto type = program_.types_[c.type_];
+        switch (c.kind_) {
+            case ssa_op::constant:
+                return make_node<float_rep>(c.val_);
+            case ssa_op::copy:
+                return operand(d, c.lhs_);
+            case ssa_op::binary:
+                return make_node<binary_rep>(operand(d, c.lhs_), operand(d, c.rhs_), c.op_, type);
+            case ssa_op::fma:
+                return make_node<fma_rep>(operand(d, c.lhs_), operand(d, c.rhs_), operand(d, c.aux_), c.flags_ & fma_negate_product, c.flags_ & fma_negate_addend, type);
+            case ssa_op::access:
+                return make_node<access_rep>(operand(d, c.lhs_), c.rhs_, type);
+            case ssa_op::create:
+                return make_node<create_rep>(list(d, c), type);
+            case ssa_op::apply:
+                return make_node<apply_rep>(list(d, c), program_.types_[program_.defs_[c.aux_].type_], defs_[c.aux_]->is_func());
+            case ssa_op::intrinsic:
+                return make_node<intrinsic_rep>((intrinsic)c.aux_, list(d, c), type);
+            default:
+                throw std::runtime_error("Cannot lower program: unexpected argument instruction");
+        }
+    }
+
+    std::vector<ir_ptr> list(const ssa_definition& d, const ssa_instruction& c) {
+        std::vector<ir_ptr> ops;
+        for (auto i = c.lhs_; i < c.lhs_ + c.rhs_; ++i) {
+            ops.push_back(operand(d, d.operands_[i]));
+        }
+        return ops;
+    }
+
+    ir_ptr operand(const ssa_definition& d, std::uint32_t i) {
+        if (auto& v = vars_[i]) {
+            return make_node<varref_rep>(v, v->type());
+        }
+        auto& c = d.code_[i];
+        if (c.kind_ != ssa_op::constant) {
+            throw std::runtime_error("Cannot lower program: operand is neither a variable nor a literal");
+        }
+        return make_node<float_rep>(c.val_);
+    }
+};
+
+inline ssa_program to_ssa(const ir_ptr& program) {
+    return ssa_builder().build(program);
+}
+
+inline ir_ptr from_ssa(const ssa_program& program) {
+    return ssa_lowering(program).lower();
+}
+
+} //namespace ir
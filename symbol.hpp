@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Process-wide table of interned identifiers. Ids are dense and stable, and
+// entries never move and are never freed, so a symbol reads its name without
+// locking. Interning locks only one of `num_shards` shards, chosen by the
+// hash of the string, so threads interning different names rarely contend.
+struct symbol_table {
+    struct entry {
+        std::string   str;
+        std::uint32_t id;
+    };
+
+    static symbol_table& get() {
+        static symbol_table table;
+        return table;
+    }
+
+    const entry* intern(std::string_view s) {
+        auto& shard = shards_[std::hash<std::string_view>()(s) % num_shards];
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        auto it = shard.entries_.find(s);
+        if (it != shard.entries_.end()) {
+            return it->second;
+        }
+        shard.storage_.push_back({std::string(s), next_id_++});
+        auto e = &shard.storage_.back();
+        shard.entries_.insert({e->str, e});
+        return e;
+    }
+
+    // The entry of the empty name, which has id 0.
+    const entry* empty() const {
+        return empty_;
+    }
+
+    std::size_t size() const {
+        return next_id_;
+    }
+
+private:
+    static constexpr unsigned num_shards = 64;
+
+    struct shard {
+        std::mutex mutex_;
+        std::unordered_map<std::string_view, const entry*> entries_;   // keys view into storage_
+        std::deque<entry> storage_;
+    };
+
+    symbol_table() {
+        empty_ = intern("");
+    }
+
+    std::atomic<std::uint32_t> next_id_{0};
+    shard shards_[num_shards];
+    const entry* empty_;
+};
+
+// An interned identifier: comparison and hashing are integer operations.
+// The default symbol is the empty name.
+struct symbol {
+    symbol() : entry_(symbol_table::get().empty()) {}
+    symbol(const std::string& s) : entry_(symbol_table::get().intern(s)) {}
+    symbol(const char* s) : entry_(symbol_table::get().intern(s)) {}
+
+    std::uint32_t id() const {
+        return entry_->id;
+    }
+
+    const std::string& str() const {
+        return entry_->str;
+    }
+
+    bool empty() const {
+        return entry_->id == 0;
+    }
+
+    bool operator==(symbol other) const {return entry_ == other.entry_;}
+    bool operator!=(symbol other) const {return entry_ != other.entry_;}
+    bool operator< (symbol other) const {return id() <  other.id();}
+
+private:
+    const symbol_table::entry* entry_;
+};
+
+inline std::ostream& operator<<(std::ostream& o, symbol s) {
+    return o << s.str();
+}
+
+namespace std {
+template <>
+struct hash<symbol> {
+    std::size_t operator()(symbol s) const {
+        return s.id();
+    }
+};
+}
@@ -1,56 +1,153 @@
+#pragma once
+
+#include <functional>
+#include <unordered_set>
+
+#include "parallel.hpp"
 #include "visitor.hpp"
 
-ir::ir_ptr create_arblang_ir(std::shared_ptr<core::block_expr> e) {
+using function_pass = std::function<void(ir::ir_ptr)>;
+
+// Lowered, canonicalized and optimized functions, keyed by the structural hash
+// of their definition (see core::definition_hasher). An entry also records
+// the function's name and signature and is reused only if they match, so a
+// hash collision compiles the function instead of reusing another's body.
+//
+// Entries hold their own copies of the bodies, and every compilation that
+// reuses one gets a fresh copy, so passes run on a returned program never
+// change the cache. Calls in an entry have no callee_: the copy's calls are
+// linked by name to the functions of the program that reuses it. Entries
+// share types with the programs they were compiled into, so a cache must
+// always be used with the same type context and passes. Their nodes are
+// allocated from the heap and freed on eviction: the cache holds exactly the
+// functions of the last program compiled with it.
+struct function_cache {
+    struct entry {
+        symbol                  name_;
+        std::vector<ir::ir_ptr> args_;
+        ir::ir_ptr              body_;
+        type_ptr                type_;
+    };
+
+    std::unordered_map<std::uint64_t, entry> entries_;
+    unsigned hits_   = 0;   // functions reused by the last compilation
+    unsigned misses_ = 0;   // functions compiled by the last compilation
+};
+
+// Lowers a block of definitions to a nested IR program. Signatures are lowered
+// in order, so a function only sees the types and functions defined before it;
+// the bodies are then lowered and canonicalized concurrently on `num_threads`
+// threads (0: one per hardware thread), run through `passes` (if any), and
+// finally nested in definition order. Passes run concurrently on the functions
+// of one call depth at a time, so a function's callees are finished before any
+// pass sees its calls.
+//
+// With a `cache`, a function whose definition and dependencies are unchanged
+// since the last compilation reuses its cached body instead, and only the
+// functions compiled anew are copied into the cache.
+ir::ir_ptr create_arblang_ir(std::shared_ptr<core::block_expr> e, unsigned num_threads = 0, const std::vector<function_pass>& passes = {}, function_cache* cache = nullptr) {
+    struct function_task {
+        unsigned               index;
+        const core::func_expr* expr;
+        core::create_ir        creator;  // the definitions visible to the function, shared with `creator` below
+    };
+
     std::vector<ir::ir_ptr> statements;
+    std::vector<function_task> tasks;
     auto creator = core::create_ir();
 
-    for (auto& s: e->statements_) {
-        if (!s->is_struct() && !s->is_func()) {
+    std::vector<std::uint64_t> hashes;
+    if (cache) {
+        hashes = core::definition_hasher().hash(*e);
+        cache->hits_ = 0;
+    }
+    auto cached = [&](unsigned i) -> const function_cache::entry* {
+        if (!cache) return nullptr;
+        auto it = cache->entries_.find(hashes[i]);
+        return it == cache->entries_.end()? nullptr: &it->second;
+    };
+    // The function a call in a cached body refers to in this program.
+    auto callee = [&](const ir::apply_rep& a) -> const core::create_ir::definition* {
+        auto def = creator.lookup(a.func_->is_func()->name_.str());
+        return def && def->func_ && def->type_ == a.func_? def: nullptr;
+    };
+    // An entry found by hash is reused only if it is for a function of the same
+    // name and signature whose callees are defined with the signatures it calls,
+    // so a hash collision is compiled instead of reusing the wrong body.
+    auto reusable = [&](const function_cache::entry& c, const ir::func_rep& decl) {
+        if (c.name_ != decl.name_ || c.type_ != decl.type()) {
+            return false;
+        }
+        for (auto l = c.body_->is_let(); l; l = l->scope_->is_let()) {
+            auto a = l->val_->is_apply();
+            if (a && !callee(*a)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto relink = [&](const ir::apply_rep& a) {
+        return callee(a)->func_;
+    };
+
+    for (unsigned i = 0; i < e->statements_.size(); ++i) {
+        auto& s = e->statements_[i];
+        if (auto f = s->is_func()) {
+            auto decl = creator.declare(*f);
+            auto c = cached(i);
+            if (c && reusable(*c, *decl)) {
+                auto copy = ir::copy_function(c->args_, c->body_, relink);
+                decl = make_node<ir::func_rep>(f->name_, copy.args_, copy.body_, c->type_);
+                ++cache->hits_;
+            } else {
+                tasks.push_back({(unsigned)statements.size(), f, creator});
+            }
+            creator.add_definition(f->name_, decl->type(), decl.get());
+            statements.push_back(decl);
+        } else if (s->is_struct()) {
+            s->accept(creator);
+            statements.push_back(creator.statement_);
+        } else {
             throw std::runtime_error("Can only transform struct/func definitions");
         }
-        s->accept(creator);
-        statements.push_back(creator.statement_);
         creator.reset();
     }
 
-    auto canon = ir::canonical();
-
-    for (auto& s: statements) {
-        if (!s->is_func()) { continue; }
-
-        // Get the list of lets created in the function
-        s->is_func()->body_->accept(canon);
-        auto new_lets = canon.new_lets;
-
-        // Set the type and scope of the last defined let to be varref of the let and it's type
-        auto return_val = std::make_shared<ir::varref_rep>(new_lets.back()->is_let()->var_, new_lets.back()->is_let()->var_->type());
-        new_lets.back()->is_let()->set_scope(return_val);
-        new_lets.back()->is_let()->set_type(return_val->type());
-
-        // Set the types of the lets
-        for (int i = new_lets.size()-2; i >=0; --i) {
-            new_lets[i]->is_let()->set_type(new_lets[i+1]->type_);
-        }
-
-        // Nest the scopes of the lets
-        for (unsigned i = 0; i < new_lets.size()-1; ++i) {
-            auto& l = new_lets[i];
-            auto& n = new_lets[i+1];
-            l->is_let()->set_scope(n);
+    auto& types = type_context::current();
+    parallel_for(tasks.size(), num_threads, [&](std::size_t i) {
+        type_scope scope(types);
+        auto& t = tasks[i];
+        auto f = statements[t.index]->is_func();
+
+        t.creator.define(*f, *t.expr);
+        f->set_body(ir::canonical().canonicalize(f->body_));
+    });
+
+    if (!passes.empty()) {
+        // Group the functions by call depth: a function is one deeper than its deepest compiled callee.
+        std::unordered_map<const ir::func_rep*, unsigned> depth;
+        std::vector<std::vector<unsigned>> waves;
+        for (auto& t: tasks) {
+            auto f = statements[t.index]->is_func();
+            unsigned d = 0;
+            for (auto l = f->body_->is_let(); l; l = l->scope_->is_let()) {
+                if (auto a = l->val_->is_apply()) {
+                    auto it = depth.find(a->callee_);
+                    if (it != depth.end()) d = std::max(d, it->second + 1);
+                }
+            }
+            depth[f] = d;
+            if (waves.size() <= d) waves.resize(d + 1);
+            waves[d].push_back(t.index);
         }
 
-        // Insert them in the deepest scope of the statement
-        if (!s->is_func()->body_->is_let()) {
-            s->is_func()->set_body(new_lets.front());
-        }
-
-        auto let = s->is_func()->body_->is_let();
-        while(true) {
-            if(!let->scope_->is_let()) {
-                let->set_scope(new_lets.front());
-                break;
-            }
-            let = let->scope_->is_let();
+        for (auto& wave: waves) {
+            parallel_for(wave.size(), num_threads, [&](std::size_t i) {
+                type_scope scope(types);
+                for (auto& p: passes) {
+                    p(statements[wave[i]]);
+                }
+            });
         }
     }
 
@@ -66,44 +163,86 @@ ir::ir_ptr create_arblang_ir(std::shared_ptr<core::block_expr> e) {
         }
     }
 
+    // Validate the statements one at a time. A reused function is a copy of
+    // one validated when it was compiled, so only the structs and the
+    // functions compiled here are checked.
     auto valid = ir::validate();
-    statements.front()->accept(valid);
+    valid.follow_scopes_ = false;
+    for (auto& s: statements) {
+        if (s->is_struct()) s->accept(valid);
+    }
+    for (auto& t: tasks) {
+        statements[t.index]->accept(valid);
+    }
+
+    if (cache) {
+        // Store the functions compiled here; the hits are in the cache already.
+        // Entries are allocated from the heap, not from this program's arena,
+        // so that each one is freed when it is evicted.
+        cache->misses_ = tasks.size();
+        arena_scope heap(nullptr);
+        for (auto& t: tasks) {
+            auto f = statements[t.index]->is_func();
+            auto copy = ir::copy_function(f->args_, f->body_, [](const ir::apply_rep&) -> ir::func_rep* {return nullptr;});
+            cache->entries_[hashes[t.index]] = {f->name_, copy.args_, copy.body_, f->type()};
+        }
+
+        // Evict the functions that are no longer in the program.
+        std::unordered_set<std::uint64_t> live(hashes.begin(), hashes.end());
+        for (auto it = cache->entries_.begin(); it != cache->entries_.end();) {
+            it = live.count(it->first)? std::next(it): cache->entries_.erase(it);
+        }
+    }
 
     // return the top-most statement
     return statements.front();
 };
 
 void constant_propagate(ir::ir_ptr nested) {
-    bool prop = true;
-
-    while(prop) {
-        auto propagate = ir::constant_prop();
-        nested->accept(propagate);
-        prop = propagate.propagation_perfromed();
-    }
+    auto propagate = ir::constant_prop();
+    nested->accept(propagate);
 }
 
 void elim_dead_code(ir::ir_ptr nested) {
-    bool elim = true;
+    auto eliminate = ir::eliminate_dead_code();
+    nested->accept(eliminate);
+}
 
-    while (elim) {
-        auto unused = ir::unused_variables();
-        nested->accept(unused);
-        auto unused_set = unused.unused_set();
+void elim_common_subexpressions(ir::ir_ptr nested) {
+    auto cse = ir::eliminate_common_subexpressions();
+    nested->accept(cse);
+}
 
-        auto eliminate = ir::eliminate_dead_code(unused_set);
-        nested->accept(eliminate);
+void inline_functions(ir::ir_ptr nested) {
+    auto inliner = ir::inline_calls();
+    nested->accept(inliner);
+}
 
-        elim = unused_set.empty();
-    }
+void scalar_replace(ir::ir_ptr nested) {
+    auto sroa = ir::scalar_replacement();
+    nested->accept(sroa);
 }
 
-void elim_common_subexpressions(ir::ir_ptr nested) {
-    while (true) {
-        auto cse = ir::eliminate_common_subexpressions();
-        nested->accept(cse);
-        if (cse.rename_map_.empty()) {
-            break;
-        }
-    }
-}
\ No newline at end of file
+void simplify_algebra(ir::ir_ptr nested) {
+    auto simplify = ir::simplify();
+    nested->accept(simplify);
+}
+
+void simplify_fast_math(ir::ir_ptr nested) {
+    auto simplify = ir::simplify(true);
+    nested->accept(simplify);
+}
+
+void contract_fused(ir::ir_ptr nested) {
+    auto contract = ir::contract_fma();
+    nested->accept(contract);
+}
+
+// Pass pipelines for pass_manager::parse. The standard pipeline contracts
+// products into fused multiply-adds, which may change results in the last bit;
+// the strict pipeline does not, and reproduces unfused IEEE arithmetic exactly.
+// The fast-math pipeline may also change results for infinities, NaNs and
+// signed zeros.
+const char* const standard_pipeline  = "inline,sroa,cp,simplify,dce,cse,contract,dce";
+const char* const strict_pipeline    = "inline,sroa,cp,simplify,dce,cse,dce";
+const char* const fast_math_pipeline = "inline,sroa,cp,simplify_fast,dce,cse,contract,dce";
\ No newline at end of file
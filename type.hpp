@@ -1,19 +1,35 @@
+#pragma once
+
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
+#include "arena.hpp"
+#include "symbol.hpp"
+
 struct float_type;
 struct struct_type;
 struct func_type;
 
+// Precision in which values of the float type are stored and evaluated. It is
+// chosen per type context, and folding and every backend follow it.
+enum class precision {f32, f64};
+
+// `x` rounded to precision `p`.
+inline double round_to(precision p, double x) {
+    return p == precision::f32? (double)(float)x: x;
+}
+
 struct typeobj {
     virtual float_type*  is_float()  {return nullptr;}
     virtual struct_type* is_struct() {return nullptr;}
     virtual func_type*   is_func()   {return nullptr;}
 
-    std::string name_;
-    virtual std::string name() const {
+    symbol name_;
+    virtual symbol name() const {
         return name_;
     }
 };
@@ -21,12 +37,14 @@ struct typeobj {
 using type_ptr = std::shared_ptr<typeobj>;
 
 struct field {
-    std::string name;
+    symbol      name;
     type_ptr    type;
 };
 
 struct float_type : typeobj {
-    float_type() {
+    precision precision_;
+
+    float_type(precision p = precision::f64) : precision_(p) {
         name_ = "float";
     }
     float_type* is_float() override {return this;}
@@ -35,7 +53,7 @@ struct float_type : typeobj {
 struct struct_type : typeobj {
     std::vector<field> fields_;
 
-    struct_type(std::string name, std::vector<field> fields) : fields_(fields) {name_ = name;}
+    struct_type(symbol name, std::vector<field> fields) : fields_(fields) {name_ = name;}
 
     struct_type* is_struct() override {return this;}
 };
@@ -44,7 +62,139 @@ struct func_type : typeobj {
     type_ptr ret_;
     std::vector<field> args_;
 
-    func_type(std::string name, type_ptr ret, std::vector<field> args) : ret_(ret), args_(args) {name_ = name;}
+    func_type(symbol name, type_ptr ret, std::vector<field> args) : ret_(ret), args_(args) {name_ = name;}
 
     func_type* is_func() override {return this;}
 };
+
+// Interns types structurally: equal types share one object, so type identity
+// is a pointer comparison. Types are allocated on the heap, not from the
+// current arena, and live as long as the context. Safe to use from several
+// threads.
+struct type_context {
+    type_context(precision p = precision::f64) : float_(std::make_shared<float_type>(p)) {}
+
+    type_context(const type_context&) = delete;
+    type_context& operator=(const type_context&) = delete;
+
+    type_ptr get_float() const {
+        return float_;
+    }
+
+    precision float_precision() const {
+        return float_->is_float()->precision_;
+    }
+
+    type_ptr get_struct(symbol name, const std::vector<field>& fields) {
+        return intern(key(0, name, nullptr, fields), [&] {return std::make_shared<struct_type>(name, fields);});
+    }
+
+    type_ptr get_func(symbol name, const type_ptr& ret, const std::vector<field>& args) {
+        return intern(key(1, name, ret, args), [&] {return std::make_shared<func_type>(name, ret, args);});
+    }
+
+    std::size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return types_.size() + 1;
+    }
+
+    // The context of this thread's session; a process-wide one if none is set.
+    static type_context& current() {
+        static type_context global;
+        auto c = current_ptr();
+        return c? *c: global;
+    }
+
+    static type_context*& current_ptr() {
+        static thread_local type_context* current_ = nullptr;
+        return current_;
+    }
+
+private:
+    using type_key = std::vector<std::uintptr_t>;
+
+    struct key_hash {
+        std::size_t operator()(const type_key& k) const {
+            std::size_t h = 0;
+            for (auto v: k) {
+                h = (h ^ std::hash<std::uintptr_t>()(v)) * 1099511628211ull;
+            }
+            return h;
+        }
+    };
+
+    // Component types are already interned, so their addresses identify them.
+    static type_key key(unsigned kind, symbol name, const type_ptr& ret, const std::vector<field>& fields) {
+        type_key k = {kind, name.id(), (std::uintptr_t)ret.get()};
+        for (auto& f: fields) {
+            k.push_back(f.name.id());
+            k.push_back((std::uintptr_t)f.type.get());
+        }
+        return k;
+    }
+
+    template <typename Make>
+    type_ptr intern(type_key k, Make make) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& t = types_[std::move(k)];
+        if (!t) t = make();
+        return t;
+    }
+
+    type_ptr float_;
+    std::mutex mutex_;
+    std::unordered_map<type_key, type_ptr, key_hash> types_;
+};
+
+// Makes `c` the type context of this thread for the lifetime of the scope.
+struct type_scope {
+    type_context* prev_;
+
+    type_scope(type_context& c) : prev_(type_context::current_ptr()) {
+        type_context::current_ptr() = &c;
+    }
+
+    ~type_scope() {
+        type_context::current_ptr() = prev_;
+    }
+};
+
+// Values are laid out in structure-of-arrays form by the backends: a float
+// occupies one column, a struct the columns of its fields, depth-first.
+inline unsigned column_count(const type_ptr& t) {
+    if (auto s = t->is_struct()) {
+        unsigned n = 0;
+        for (auto& f: s->fields_) {
+            n += column_count(f.type);
+        }
+        return n;
+    }
+    return 1;
+}
+
+// The first float type within `t`, depth-first; null if `t` has no floats.
+// The types of one program are interned in one context, so they share it.
+inline float_type* find_float(const type_ptr& t) {
+    if (auto f = t->is_float()) {
+        return f;
+    }
+    if (auto s = t->is_struct()) {
+        for (auto& f: s->fields_) {
+            if (auto r = find_float(f.type)) return r;
+        }
+    }
+    if (auto f = t->is_func()) {
+        if (auto r = find_float(f->ret_)) return r;
+        for (auto& a: f->args_) {
+            if (auto r = find_float(a.type)) return r;
+        }
+    }
+    return nullptr;
+}
+
+// The precision of the floats in `t`; f64 if it has none, as it then makes no
+// difference.
+inline precision float_precision(const type_ptr& t) {
+    auto f = find_float(t);
+    return f? f->precision_: precision::f64;
+}
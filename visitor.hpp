@@ -1,12 +1,27 @@
 #pragma once
 
-#include <set>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <unordered_set>
 
 #include "core_arblang.hpp"
 #include "ir_arblang.hpp"
+#include "vmath.hpp"
 
 namespace core {
 
+// Writes the shortest text that parses back to exactly `v`; the special
+// values are written as inf, -inf, nan and -nan, which the parser accepts.
+inline std::ostream& print_float(std::ostream& o, double v) {
+    char buf[32];
+    auto r = std::to_chars(buf, buf + sizeof(buf), v);
+    return o.write(buf, r.ptr - buf);
+}
+
 struct visitor {
     virtual void visit(const expression&) = 0;
     virtual void visit(const func_expr& e) { visit((expression&) e); };
@@ -51,7 +66,7 @@ struct print : visitor {
     }
 
     virtual void visit(const float_expr& e) override {
-        out_ << e.val_;
+        print_float(out_, e.val_);
     }
 
     virtual void visit(const vardef_expr& e) override {
@@ -63,15 +78,28 @@ struct print : visitor {
     }
 
     virtual void visit(const let_expr& e) override {
-        out_ << "(let   (";
-        e.var_->accept(*this);
-        out_ << " (";
-        e.val_->accept(*this);
-        out_ << "))\nin  ";
+        // Print the chain iteratively, and close its lets at the end.
+        auto header = [&](const let_expr& l) {
+            out_ << "(let   (";
+            l.var_->accept(*this);
+            out_ << " (";
+            l.val_->accept(*this);
+            out_ << "))\nin  ";
+        };
+        header(e);
+        std::size_t depth = 1;
+        auto body = e.body_;
+        while (auto l = body->is_let()) {
+            header(*l);
+            ++depth;
+            body = l->body_;
+        }
 
-        e.body_->accept(*this);
+        body->accept(*this);
 
-        out_ << ")\n";
+        for (; depth; --depth) {
+            out_ << ")\n";
+        }
     }
 
     virtual void visit(const binary_expr& e) override {
@@ -114,6 +142,15 @@ struct print : visitor {
         out_ << "))";
     }
 
+    virtual void visit(const apply_expr& e) override {
+        out_ << "(apply " << e.func_ << "(";
+        for (auto& a: e.args_) {
+            a->accept(*this);
+            out_ << " ";
+        }
+        out_ << "))";
+    }
+
     virtual void visit(const block_expr& e) override {
         for (auto& s: e.statements_) {
             s->accept(*this);
@@ -124,36 +161,69 @@ struct print : visitor {
 };
 
 struct create_ir : visitor {
-    std::unordered_map<std::string, type_ptr> def_types_;
+    // A type or function in scope. A name resolves to its first definition.
+    struct definition {
+        type_ptr      type_;
+        ir::func_rep* func_;    // null for a type
+        unsigned      index_;   // position among the definitions
+    };
+    using definition_table = std::unordered_map<std::string, definition>;
+
+    // Copies of a creator share one table, so copying one to lower a function
+    // body elsewhere is cheap; a copy only sees the definitions made before it.
+    // The table must not grow while copies are lowering bodies concurrently.
+    std::shared_ptr<definition_table> defs_;
+    unsigned num_defs_ = 0;
     std::unordered_map<std::string, ir::ir_ptr> scope_vars_;
 
     ir::ir_ptr statement_;
 
-    create_ir() : def_types_({{"float", std::make_shared<float_type>()}}) {};
+    create_ir() : defs_(std::make_shared<definition_table>()) {
+        add_definition("float", type_context::current().get_float());
+    };
+
+    void add_definition(const std::string& name, type_ptr type, ir::func_rep* func = nullptr) {
+        defs_->insert({name, {type, func, num_defs_++}});
+    }
+
+    // The definition of `name` visible to this creator, or null.
+    const definition* lookup(const std::string& name) const {
+        auto it = defs_->find(name);
+        return it == defs_->end() || it->second.index_ >= num_defs_? nullptr: &it->second;
+    }
 
     void reset() {
         statement_ = nullptr;
         scope_vars_.clear();
     }
 
-    virtual void visit(const func_expr& e) override {
-        auto it = def_types_.find(e.ret_);
-        if (it == def_types_.end()) {
+    // Lowers the signature of a function, leaving its arguments in scope and its body unset.
+    std::shared_ptr<ir::func_rep> declare(const func_expr& e) {
+        auto def = lookup(e.ret_);
+        if (!def) {
             throw std::runtime_error("Function \"" + e.name_ + "\"'s return type \"" + e.ret_ + "\" is undefined");
         }
-        auto ret = it->second;
+        auto ret = def->type_;
 
         std::vector<ir::ir_ptr> args;
         for (auto& a: e.args_) {
             a->accept(*this);
             args.push_back(statement_);
         }
+        return make_node<ir::func_rep>(e.name_, ret, args, nullptr);
+    }
 
+    // Lowers the body of a function declared by this creator.
+    void define(ir::func_rep& f, const func_expr& e) {
         e.body_->accept(*this);
-        auto body = statement_;
+        f.set_body(statement_);
+    }
 
-        statement_ = std::make_shared<ir::func_rep>(e.name_, ret, args, body);
-        def_types_.insert({e.name_, statement_->type()});
+    virtual void visit(const func_expr& e) override {
+        auto f = declare(e);
+        define(*f, e);
+        statement_ = f;
+        add_definition(e.name_, statement_->type(), f.get());
     }
 
     virtual void visit(const struct_expr& e) override {
@@ -163,20 +233,20 @@ struct create_ir : visitor {
             fields.push_back(statement_);
         }
 
-        statement_ = std::make_shared<ir::struct_rep>(e.name_, fields);
-        def_types_.insert({e.name_, statement_->type()});
+        statement_ = make_node<ir::struct_rep>(e.name_, fields);
+        add_definition(e.name_, statement_->type());
     }
 
     virtual void visit(const float_expr& e) override {
-        statement_ = std::make_shared<ir::float_rep>(e.val_);
+        statement_ = make_node<ir::float_rep>(e.val_);
     }
 
     virtual void visit(const vardef_expr& e) override {
-        auto it = def_types_.find(e.type_);
-        if (it == def_types_.end()) {
+        auto def = lookup(e.type_);
+        if (!def) {
             throw std::runtime_error("Variable definiton \"" + e.var_ + "\"'s type \"" + e.type_ + "\" is undefined");
         }
-        statement_ = std::make_shared<ir::vardef_rep>(e.var_, it->second);
+        statement_ = make_node<ir::vardef_rep>(e.var_, def->type_);
         scope_vars_.insert({e.var_, statement_});
     }
 
@@ -187,20 +257,30 @@ struct create_ir : visitor {
         }
         auto def = it->second;
 
-        statement_ = std::make_shared<ir::varref_rep>(def, def->type());
+        statement_ = make_node<ir::varref_rep>(def, def->type());
     }
 
     virtual void visit(const let_expr& e) override {
-        e.var_->accept(*this);
-        auto var = statement_;
+        // Lower the chain iteratively, then nest the lets innermost first.
+        std::vector<std::pair<ir::ir_ptr, ir::ir_ptr>> lets;
+        const let_expr* l = &e;
+        expr_ptr body;
+        do {
+            l->var_->accept(*this);
+            auto var = statement_;
 
-        e.val_->accept(*this);
-        auto val = statement_;
+            l->val_->accept(*this);
+            lets.push_back({var, statement_});
 
-        e.body_->accept(*this);
-        auto body = statement_;
+            body = l->body_;
+        } while ((l = body->is_let()));
 
-        statement_ = std::make_shared<ir::let_rep>(var, val, body, body->type());
+        body->accept(*this);
+        auto result = statement_;
+        for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+            result = make_node<ir::let_rep>(it->first, it->second, result, result->type());
+        }
+        statement_ = result;
     }
 
     virtual void visit(const binary_expr& e) override {
@@ -213,14 +293,14 @@ struct create_ir : visitor {
         auto t =   lhs->type();
         auto r =   rhs->type();
 
-        if (lhs->type()->name() != rhs->type()->name()) {
+        if (lhs->type() != rhs->type()) {
             throw std::runtime_error("Cannot perform binary operation on incompatible types");
         }
         if (!lhs->type()->is_float()) {
             throw std::runtime_error("Cannot perform binary operation on non-float types");
         }
 
-        statement_ = std::make_shared<ir::binary_rep>(lhs, rhs, e.op_, lhs->type());
+        statement_ = make_node<ir::binary_rep>(lhs, rhs, e.op_, lhs->type());
     }
 
     virtual void visit(const access_expr& e) override {
@@ -230,13 +310,14 @@ struct create_ir : visitor {
         }
 
         auto def = it->second;
-        auto ref = std::make_shared<ir::varref_rep>(def, def->type());
+        auto ref = make_node<ir::varref_rep>(def, def->type());
 
         if (auto obj = def->type()->is_struct()) {
+            symbol field(e.field_);
             unsigned i = 0;
             for (; i < obj->fields_.size(); ++i) {
-                if (obj->fields_[i].name == e.field_) {
-                    statement_ = std::make_shared<ir::access_rep>(ref, i, obj->fields_[i].type);
+                if (obj->fields_[i].name == field) {
+                    statement_ = make_node<ir::access_rep>(ref, i, obj->fields_[i].type);
                     return;
                 }
             }
@@ -246,11 +327,11 @@ struct create_ir : visitor {
     }
 
     virtual void visit(const create_expr& e) override {
-        auto it = def_types_.find(e.struct_);
-        if (it == def_types_.end()) {
+        auto def = lookup(e.struct_);
+        if (!def) {
             throw std::runtime_error("Cannot create object of type \"" + e.struct_ + "\"' because the type hasn't been defined");
         }
-        auto strct = it->second;
+        auto strct = def->type_;
 
         if (!strct->is_struct()) {
             throw std::runtime_error("Cannot create object of non-struct type");
@@ -268,15 +349,20 @@ struct create_ir : visitor {
             }
             fields.push_back(statement_);
         }
-        statement_ = std::make_shared<ir::create_rep>(fields, strct);
+        statement_ = make_node<ir::create_rep>(fields, strct);
     }
 
     virtual void visit(const apply_expr& e) override {
-        auto it = def_types_.find(e.func_);
-        if (it == def_types_.end() || !it->second->is_func()) {
+        auto def = lookup(e.func_);
+        ir::intrinsic fn;
+        if (!def && ir::find_intrinsic(e.func_, fn)) {
+            apply_intrinsic(fn, e);
+            return;
+        }
+        if (!def || !def->type_->is_func()) {
             throw std::runtime_error("Cannot apply function \"" + e.func_ + "\"' because the it hasn't been defined");
         }
-        auto func = it->second;
+        auto func = def->type_;
 
         if (!func->is_func()) {
             throw std::runtime_error("Cannot apply a non-function type");
@@ -284,6 +370,9 @@ struct create_ir : visitor {
 
         std::vector<ir::ir_ptr> args;
         const auto& func_args = func->is_func()->args_;
+        if (func_args.size() != e.args_.size()) {
+            throw std::runtime_error("Cannot apply function \"" + e.func_ + "\": expected " + std::to_string(func_args.size()) + " arguments");
+        }
 
         for (unsigned i = 0; i < e.args_.size(); ++i) {
             const auto& f = e.args_[i];
@@ -294,12 +383,167 @@ struct create_ir : visitor {
             }
             args.push_back(statement_);
         }
-        statement_ = std::make_shared<ir::apply_rep>(args, func);
+        statement_ = make_node<ir::apply_rep>(args, func, def->func_);
     }
 
     virtual void visit(const expression& e) override {}
 
+    // Lowers a call to an intrinsic, which takes and returns floats.
+    void apply_intrinsic(ir::intrinsic fn, const apply_expr& e) {
+        auto arity = ir::intrinsic_arity(fn);
+        if (e.args_.size() != arity) {
+            throw std::runtime_error("Cannot apply function \"" + e.func_ + "\": expected " + std::to_string(arity) + " arguments");
+        }
+
+        std::vector<ir::ir_ptr> args;
+        for (unsigned i = 0; i < e.args_.size(); ++i) {
+            e.args_[i]->accept(*this);
+
+            if (!statement_->type()->is_float()) {
+                throw std::runtime_error("Cannot apply function \"" + e.func_ + "\": argument " + std::to_string(i) + " is not a float");
+            }
+            args.push_back(statement_);
+        }
+        statement_ = make_node<ir::intrinsic_rep>(fn, args, args.front()->type());
+    }
+
+
+};
+
+// Structural (Merkle) hashes of the definitions of a block. A definition's
+// hash covers its own structure and the hashes of the definitions it names:
+// argument, field and variable types, created structs and applied functions.
+// It therefore changes exactly when the definition or one of its
+// dependencies does. Names resolve as in create_ir: to the first earlier
+// definition of that name.
+struct definition_hasher : visitor {
+    std::unordered_map<std::string, std::uint64_t> defs_;
+    std::uint64_t hash_ = 0;
+
+    std::vector<std::uint64_t> hash(const block_expr& b) {
+        defs_.clear();
+        std::vector<std::uint64_t> hashes;
+        for (auto& s: b.statements_) {
+            hash_ = 0;
+            s->accept(*this);
+            hashes.push_back(hash_);
+            if (auto f = s->is_func()) {
+                defs_.insert({f->name_, hash_});
+            } else if (auto t = s->is_struct()) {
+                defs_.insert({t->name_, hash_});
+            }
+        }
+        return hashes;
+    }
+
+    virtual void visit(const func_expr& e) override {
+        mix(1);
+        mix(e.name_);
+        reference(e.ret_);
+        list(e.args_);
+        e.body_->accept(*this);
+    }
+
+    virtual void visit(const struct_expr& e) override {
+        mix(2);
+        mix(e.name_);
+        list(e.fields_);
+    }
+
+    virtual void visit(const float_expr& e) override {
+        std::uint64_t bits;
+        std::memcpy(&bits, &e.val_, sizeof(bits));
+        mix(3);
+        mix(bits);
+    }
+
+    virtual void visit(const vardef_expr& e) override {
+        mix(4);
+        mix(e.var_);
+        reference(e.type_);
+    }
+
+    virtual void visit(const varref_expr& e) override {
+        mix(5);
+        mix(e.var_);
+    }
+
+    virtual void visit(const let_expr& e) override {
+        const let_expr* l = &e;
+        expr_ptr body;
+        do {
+            mix(6);
+            l->var_->accept(*this);
+            l->val_->accept(*this);
+            body = l->body_;
+        } while ((l = body->is_let()));
+        body->accept(*this);
+    }
+
+    virtual void visit(const binary_expr& e) override {
+        mix(7);
+        mix(e.op_);
+        e.lhs_->accept(*this);
+        e.rhs_->accept(*this);
+    }
+
+    virtual void visit(const access_expr& e) override {
+        mix(8);
+        mix(e.object_);
+        mix(e.field_);
+    }
+
+    virtual void visit(const create_expr& e) override {
+        mix(9);
+        reference(e.struct_);
+        list(e.fields_);
+    }
+
+    virtual void visit(const apply_expr& e) override {
+        mix(10);
+        reference(e.func_);
+        list(e.args_);
+    }
+
+    virtual void visit(const expression& e) override {
+        throw std::runtime_error("Cannot hash definition: unexpected expression");
+    }
+
+private:
+    void mix(std::uint64_t v) {
+        // combine, then the splitmix64 finalizer
+        std::uint64_t h = hash_ ^ (v + 0x9e3779b97f4a7c15ull + (hash_ << 6) + (hash_ >> 2));
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        hash_ = h ^ (h >> 31);
+    }
+
+    void mix(const std::string& s) {
+        std::uint64_t h = 14695981039346656037ull;
+        for (unsigned char c: s) {
+            h = (h ^ c) * 1099511628211ull;
+        }
+        mix(h);
+        mix(s.size());
+    }
+
+    // Names of definitions contribute the definition's hash; builtin and
+    // undefined names contribute themselves.
+    void reference(const std::string& name) {
+        auto it = defs_.find(name);
+        if (it != defs_.end()) {
+            mix(it->second);
+        } else {
+            mix(name);
+        }
+    }
 
+    void list(const std::vector<expr_ptr>& es) {
+        mix(es.size());
+        for (auto& e: es) {
+            e->accept(*this);
+        }
+    }
 };
 
 }
@@ -317,6 +561,8 @@ struct visitor {
     virtual void visit(varref_rep& e) {visit((ir_expression&) e);};
     virtual void visit(let_rep& e)    {visit((ir_expression&) e);};
     virtual void visit(binary_rep& e) {visit((ir_expression&) e);};
+    virtual void visit(fma_rep& e)    {visit((ir_expression&) e);};
+    virtual void visit(intrinsic_rep& e) {visit((ir_expression&) e);};
     virtual void visit(access_rep& e) {visit((ir_expression&) e);};
     virtual void visit(create_rep& e) {visit((ir_expression&) e);};
     virtual void visit(apply_rep& e)  {visit((ir_expression&) e);};
@@ -390,7 +636,7 @@ struct print : visitor {
     }
 
     virtual void visit(float_rep& e) override {
-        out_ << e.val_;
+        core::print_float(out_, e.val_);
     }
 
     virtual void visit(vardef_rep& e) override {
@@ -457,6 +703,26 @@ struct print : visitor {
         out_ << ")";
     }
 
+    virtual void visit(fma_rep& e) override {
+        const char* names[2][2] = {{"fma", "fms"}, {"fnma", "fnms"}};
+        out_ << "( " << names[e.negate_product_][e.negate_addend_] << " ";
+        e.lhs_->accept(*this);
+        out_ << " ";
+        e.rhs_->accept(*this);
+        out_ << " ";
+        e.addend_->accept(*this);
+        out_ << ")";
+    }
+
+    virtual void visit(intrinsic_rep& e) override {
+        out_ << "( " << intrinsic_name(e.fn_);
+        for (auto& a: e.args_) {
+            out_ << " ";
+            a->accept(*this);
+        }
+        out_ << ")";
+    }
+
     virtual void visit(access_rep& e) override {
         e.var_->accept(*this);
         out_ << ".at(" << e.index_ << ")";
@@ -478,7 +744,7 @@ struct print : visitor {
 
     virtual void visit(apply_rep& e) override {
         out_ << "(apply ";
-        out_ << e.type_->is_func()->name_ << "(";
+        out_ << e.func_->is_func()->name_ << "(";
         for (auto& a: e.args_) {
             a->accept(*this);
             out_ << " ";
@@ -496,8 +762,307 @@ private:
 
 };
 
+// Maps the name of every function in a nested program to its definition.
+inline std::unordered_map<symbol, func_rep*> function_table(const ir_ptr& program) {
+    std::unordered_map<symbol, func_rep*> funcs;
+    auto s = program.get();
+    while (s) {
+        if (auto f = s->is_func()) {
+            funcs[f->name_] = f;
+            s = f->scope_.get();
+        } else if (auto f = s->is_struct()) {
+            s = f->scope_.get();
+        } else {
+            break;
+        }
+    }
+    return funcs;
+}
+
+// Resolves the values of canonical function bodies to the columns holding
+// them (see column_count), for backends that lower a function to straight-line
+// column code. Copies, accesses and creates only select or concatenate the
+// columns of their operands, and calls are inlined, so they emit nothing;
+// derived classes lower literals and arithmetic to a single `Column` each.
+// `error_` prefixes the messages of the exceptions thrown.
+template <typename Column>
+struct column_lowering : visitor {
+    std::unordered_map<symbol, func_rep*> funcs_;
+    std::unordered_map<const ir_expression*, std::vector<Column>> values_; // vardef -> columns
+    std::vector<Column> result_;
+
+    column_lowering(const ir_ptr& program, const char* error) : funcs_(function_table(program)), error_(error) {}
+
+    func_rep& function(const std::string& name) const {
+        auto it = funcs_.find(name);
+        if (it == funcs_.end()) {
+            throw std::runtime_error(std::string(error_) + ": function \"" + name + "\" is undefined");
+        }
+        return *it->second;
+    }
+
+    void visit(let_rep& e) override {
+        // Walk the chain iteratively: it is as long as the function.
+        ir_expression* s = &e;
+        while (auto l = s->is_let()) {
+            l->val_->accept(*this);
+            values_[l->var_.get()] = result_;
+            s = l->scope_.get();
+        }
+        s->accept(*this);
+    }
+
+    void visit(varref_rep& e) override {
+        auto it = values_.find(e.def_.get());
+        if (it == values_.end()) {
+            throw std::runtime_error(std::string(error_) + ": reference to unbound variable " + e.def_->is_vardef()->name_.str());
+        }
+        result_ = it->second;
+    }
+
+    void visit(access_rep& e) override {
+        e.var_->accept(*this);
+        auto& fields = e.var_->type()->is_struct()->fields_;
+
+        unsigned first = 0;
+        for (unsigned i = 0; i < e.index_; ++i) {
+            first += column_count(fields[i].type);
+        }
+        auto count = column_count(fields[e.index_].type);
+        result_ = std::vector<Column>(result_.begin()+first, result_.begin()+first+count);
+    }
+
+    void visit(create_rep& e) override {
+        std::vector<Column> columns;
+        for (auto& f: e.fields_) {
+            f->accept(*this);
+            columns.insert(columns.end(), result_.begin(), result_.end());
+        }
+        result_ = columns;
+    }
+
+    void visit(apply_rep& e) override {
+        auto it = funcs_.find(e.func_->is_func()->name_);
+        if (it == funcs_.end()) {
+            throw std::runtime_error(std::string(error_) + ": call to undefined function " + e.func_->is_func()->name_.str());
+        }
+        auto& f = *it->second;
+
+        for (unsigned i = 0; i < e.args_.size(); ++i) {
+            e.args_[i]->accept(*this);
+            values_[f.args_[i].get()] = result_;
+        }
+        f.body_->accept(*this);
+    }
+
+    void visit(ir_expression& e) override {
+        throw std::runtime_error(std::string(error_) + ": unexpected expression in function body");
+    }
+
+protected:
+    const char* error_;
+};
+
+// One column of a value in a simd_kernel: a local variable, an input column, or a literal.
+struct simd_leaf {
+    std::string expr_;
+    int input_ = -1;
+    bool var_ = false;
+};
+
+// Emits C++ source for a canonical function as a batched kernel:
+//   extern "C" void <identifier(name)>(std::size_t n, const real* const* in, real* const* out)
+// where `real` is float or double, as the precision of the program's float type.
+// Arguments and result are SoA columns (see column_count). The let-chain
+// becomes one straight-line step templated on the value type; the main loop
+// runs it on GCC/Clang vectors as wide as `width` doubles (4 for AVX2, 8 for
+// AVX-512), so twice as many lanes in f32, and a scalar loop handles the
+// remainder. Calls are inlined; intrinsics call the vmath functions, whose
+// source the prelude embeds.
+struct simd_kernel : column_lowering<simd_leaf> {
+    using leaf = simd_leaf;
+
+    std::ostream& out_;
+    unsigned width_;
+    precision precision_;
+
+    simd_kernel(std::ostream& out, const ir_ptr& program, unsigned width = 4)
+        : column_lowering(program, "Cannot emit kernel"), out_(out), width_(width), precision_(precision::f64) {
+        for (auto& f: funcs_) {
+            if (auto t = find_float(f.second->type())) {
+                precision_ = t->precision_;
+                break;
+            }
+        }
+    }
+
+    // Helpers shared by every kernel in a translation unit.
+    void prelude() {
+        bool f32 = precision_ == precision::f32;
+        out_ << "#include <cmath>\n"
+             << "#include <cstddef>\n"
+             << "#include <cstdint>\n"
+             << "#include <cstring>\n"
+             << "#include <limits>\n\n"
+             << vmath::source() << "\n"
+             << "namespace {\n"
+             << "typedef " << (f32? "float": "double") << " real;\n"
+             << "constexpr std::size_t width = " << (f32? 2*width_: width_) << ";\n"
+             << "typedef real vreal __attribute__((vector_size(width*sizeof(real))));\n\n"
+             << "template <typename V> inline V load(const real* p) { V v; std::memcpy(&v, p, sizeof(V)); return v; }\n"
+             << "template <typename V> inline void store(real* p, V v) { std::memcpy(p, &v, sizeof(V)); }\n"
+             << "template <typename V> inline V splat(real x) { return x - V{}; }\n"
+             << "template <typename V> inline V madd(V a, V b, V c) { V r; for (std::size_t k = 0; k < width; ++k) r[k] = std::fma(a[k], b[k], c[k]); return r; }\n"
+             << "template <> inline real madd<real>(real a, real b, real c) { return std::fma(a, b, c); }\n";
+
+        // arb_<intrinsic><V>(...): vmath lane by lane, in a loop the compiler vectorizes.
+        for (unsigned i = 0; i < num_intrinsics; ++i) {
+            std::string name = intrinsic_name((intrinsic)i);
+            bool binary = intrinsic_arity((intrinsic)i) == 2;
+            out_ << "template <typename V> inline V arb_" << name << "(V a" << (binary? ", V b": "") << ") { V r; for (std::size_t k = 0; k < width; ++k) r[k] = vmath::"
+                 << name << "(a[k]" << (binary? ", b[k]": "") << "); return r; }\n"
+                 << "template <> inline real arb_" << name << "<real>(real a" << (binary? ", real b": "") << ") { return vmath::"
+                 << name << "(a" << (binary? ", b": "") << "); }\n";
+        }
+        out_ << "}\n";
+    }
+
+    void kernel(const std::string& name) {
+        auto& f = function(name);
+
+        values_.clear();
+        body_.str("");
+        num_inputs_ = 0;
+        var_idx_ = 0;
+
+        for (auto& a: f.args_) {
+            std::vector<leaf> leaves(column_count(a->type()));
+            for (auto& l: leaves) {
+                l.input_ = num_inputs_++;
+            }
+            values_[a.get()] = leaves;
+        }
+        loaded_.assign(num_inputs_, false);
+
+        f.body_->accept(*this);
+        for (unsigned i = 0; i < result_.size(); ++i) {
+            body_ << "    store<V>(out[" << i << "] + i, " << use(result_[i], true) << ");\n";
+        }
+
+        auto id = identifier(name);
+        out_ << "\nnamespace {\n"
+             << "template <typename V>\n"
+             << "inline void " << id << "_step(std::size_t i, const real* const* in, real* const* out) {\n"
+             << body_.str()
+             << "}\n"
+             << "}\n\n"
+             << "extern \"C\" void " << id << "(std::size_t n, const real* const* in, real* const* out) {\n"
+             << "    std::size_t i = 0;\n"
+             << "    for (; i + width <= n; i += width) " << id << "_step<vreal>(i, in, out);\n"
+             << "    for (; i < n; ++i) " << id << "_step<real>(i, in, out);\n"
+             << "}\n";
+    }
+
+    void visit(float_rep& e) override {
+        std::ostringstream lit;
+        lit << std::hexfloat << e.val_ << (precision_ == precision::f32? "f": "");
+        result_ = {{lit.str()}};
+    }
+
+    void visit(binary_rep& e) override {
+        e.lhs_->accept(*this);
+        auto lhs = result_.front();
+        e.rhs_->accept(*this);
+        auto rhs = result_.front();
+
+        // Two literals would make a scalar expression; broadcast one of them.
+        auto l = use(lhs, rhs.input_ < 0 && !rhs.var_);
+        auto r = use(rhs, false);
+
+        const char* op = "";
+        switch (e.op_) {
+            case operation::add: op = " + "; break;
+            case operation::sub: op = " - "; break;
+            case operation::mul: op = " * "; break;
+            case operation::div: op = " / "; break;
+        }
+        auto var = temp();
+        body_ << "    const V " << var << " = " << l << op << r << ";\n";
+        result_ = {{var, -1, true}};
+    }
+
+    void visit(fma_rep& e) override {
+        std::string ops[3];
+        ir_ptr operands[3] = {e.lhs_, e.rhs_, e.addend_};
+        for (unsigned i = 0; i < 3; ++i) {
+            operands[i]->accept(*this);
+            ops[i] = use(result_.front(), true);
+        }
+        auto var = temp();
+        body_ << "    const V " << var << " = madd<V>(" << (e.negate_product_? "-": "") << ops[0] << ", " << ops[1] << ", "
+              << (e.negate_addend_? "-": "") << ops[2] << ");\n";
+        result_ = {{var, -1, true}};
+    }
+
+    void visit(intrinsic_rep& e) override {
+        std::string args;
+        for (auto& a: e.args_) {
+            a->accept(*this);
+            args += (args.empty()? "": ", ") + use(result_.front(), true);
+        }
+        auto var = temp();
+        body_ << "    const V " << var << " = arb_" << intrinsic_name(e.fn_) << "<V>(" << args << ");\n";
+        result_ = {{var, -1, true}};
+    }
+
+    // The C symbol of the kernel of function `name`: "arb_" followed by the
+    // name, with every character other than a letter or digit escaped as _xx
+    // in hex, so distinct names give distinct symbols.
+    static std::string identifier(const std::string& name) {
+        static const char* hex = "0123456789abcdef";
+        std::string id = "arb_";
+        for (unsigned char c: name) {
+            if (std::isalnum(c)) {
+                id += c;
+            } else {
+                id += '_';
+                id += hex[c >> 4];
+                id += hex[c & 15];
+            }
+        }
+        return id;
+    }
+
+private:
+    std::ostringstream body_;
+    std::vector<bool> loaded_;
+    unsigned num_inputs_ = 0;
+    unsigned var_idx_ = 0;
+
+    std::string temp() {
+        return "t" + std::to_string(var_idx_++);
+    }
+
+    // Input columns are loaded on first use.
+    std::string use(const leaf& l, bool broadcast) {
+        if (l.input_ >= 0) {
+            auto name = "in" + std::to_string(l.input_);
+            if (!loaded_[l.input_]) {
+                body_ << "    const V " << name << " = load<V>(in[" << l.input_ << "] + i);\n";
+                loaded_[l.input_] = true;
+            }
+            return name;
+        }
+        if (!l.var_ && broadcast) {
+            return "splat<V>(" + l.expr_ + ")";
+        }
+        return l.expr_;
+    }
+};
+
 struct canonical : visitor {
     std::vector<ir_ptr> new_lets;
+    ir_ptr result_;     // varref or float holding the value of the last expression visited
 
     unsigned var_idx_ = 0;
     std::string unique_id() {
@@ -506,104 +1071,145 @@ struct canonical : visitor {
 
     canonical() {}
 
+    // Returns `body` rewritten as a chain of lets whose values are canonical,
+    // ending in a reference to the result. User lets keep their variables.
+    ir_ptr canonicalize(const ir_ptr& body) {
+        new_lets.clear();
+
+        // Walk the outer chain iteratively: it is as long as the function.
+        auto e = body;
+        while (auto let = e->is_let()) {
+            bind(*let);
+            e = let->scope_;
+        }
+        ir_ptr result = operand(e);
+
+        // Nest the scopes of the lets, innermost first; each let has the type of the result.
+        for (auto it = new_lets.rbegin(); it != new_lets.rend(); ++it) {
+            auto let = (*it)->is_let();
+            let->set_scope(result);
+            let->set_type(result->type());
+            result = *it;
+        }
+        return result;
+    }
+
     virtual void visit(let_rep& e) override {
-        e.scope_->accept(*this);
+        bind(e);
+        auto s = e.scope_;
+        while (auto l = s->is_let()) {
+            bind(*l);
+            s = l->scope_;
+        }
+        result_ = operand(s);
     }
 
     virtual void visit(binary_rep& e) override {
-        ir_ptr lhs, rhs;
-        operation op = e.op_;
+        auto lhs = operand(e.lhs_);
+        auto rhs = operand(e.rhs_);
+        push(make_node<binary_rep>(lhs, rhs, e.op_, lhs->type()));
+    }
 
-        if (e.lhs_->is_varref() || e.lhs_->is_float()) {
-            lhs = e.lhs_;
-        } else {
-            e.lhs_->accept(*this);
-            auto last = new_lets.back()->is_let()->var_;
-            lhs = std::make_shared<varref_rep>(last, last->type());
-        }
-        if (e.rhs_->is_varref() || e.rhs_->is_float()) {
-            rhs = e.rhs_;
-        } else {
-            e.rhs_->accept(*this);
-            auto last = new_lets.back()->is_let()->var_;
-            rhs = std::make_shared<varref_rep>(last, last->type());
-        }
+    virtual void visit(fma_rep& e) override {
+        auto lhs = operand(e.lhs_);
+        auto rhs = operand(e.rhs_);
+        auto addend = operand(e.addend_);
+        push(make_node<fma_rep>(lhs, rhs, addend, e.negate_product_, e.negate_addend_, lhs->type()));
+    }
 
-        auto vardef = std::make_shared<vardef_rep>(unique_id(), e.lhs_->type());
-        auto varref = std::make_shared<varref_rep>(vardef, vardef->type());
-        new_lets.push_back(std::make_shared<let_rep>(vardef, std::make_shared<binary_rep>(lhs, rhs, op, lhs->type())));
+    virtual void visit(intrinsic_rep& e) override {
+        std::vector<ir_ptr> args;
+        for (auto& a: e.args_) {
+            args.push_back(operand(a));
+        }
+        push(make_node<intrinsic_rep>(e.fn_, args, e.type()));
     }
 
     virtual void visit(access_rep& e) override {
-        auto vardef = std::make_shared<vardef_rep>(unique_id(), e.type());
-        auto varref = std::make_shared<varref_rep>(vardef, vardef->type());
-        new_lets.push_back(std::make_shared<let_rep>(vardef, std::make_shared<access_rep>(e)));
+        push(make_node<access_rep>(e));
     }
 
     virtual void visit(create_rep& e) override {
         std::vector<ir_ptr> fields;
         for (auto& f: e.fields_) {
-            if (f->is_float() || f->is_varref()) {
-                fields.push_back(f);
-            } else {
-                f->accept(*this);
-                auto last = new_lets.back()->is_let()->var_;
-                fields.push_back(std::make_shared<varref_rep>(last, last->type()));
-            }
+            fields.push_back(operand(f));
         }
-        auto vardef = std::make_shared<vardef_rep>(unique_id(), e.type());
-        auto varref = std::make_shared<varref_rep>(vardef, vardef->type());
-        new_lets.push_back(std::make_shared<let_rep>(vardef, std::make_shared<create_rep>(fields, e.type())));
+        push(make_node<create_rep>(fields, e.type()));
     }
 
     virtual void visit(apply_rep& e) override {
         std::vector<ir_ptr> args;
         for (auto& a: e.args_) {
-            if (a->is_float() || a->is_varref()) {
-                args.push_back(a);
-            } else {
-                a->accept(*this);
-                auto last = new_lets.back()->is_let()->var_;
-                args.push_back(std::make_shared<varref_rep>(last, last->type()));
-            }
+            args.push_back(operand(a));
         }
-        auto vardef = std::make_shared<vardef_rep>(unique_id(), e.type());
-        auto varref = std::make_shared<varref_rep>(vardef, vardef->type());
-        new_lets.push_back(std::make_shared<let_rep>(vardef, std::make_shared<apply_rep>(args, e.type())));
+        push(make_node<apply_rep>(args, e.func_, e.callee_));
     }
 
     virtual void visit(ir_expression& e) override {}
 
+private:
+    // Returns a varref or float with the value of `e`, emitting lets as needed.
+    ir_ptr operand(const ir_ptr& e) {
+        if (e->is_float() || e->is_varref()) {
+            return e;
+        }
+        e->accept(*this);
+        return result_;
+    }
+
+    // Binds a new variable to the canonical value `val`.
+    void push(ir_ptr val) {
+        auto vardef = make_node<vardef_rep>(unique_id(), val->type());
+        new_lets.push_back(make_node<let_rep>(vardef, val));
+        result_ = make_node<varref_rep>(vardef, vardef->type());
+    }
+
+    // Emits the lets computing the value of a user let, bound to the user's variable.
+    void bind(let_rep& let) {
+        auto& val = let.val_;
+        if (val->is_float() || val->is_varref()) {
+            new_lets.push_back(make_node<let_rep>(let.var_, val));
+        } else if (val->is_let()) {
+            new_lets.push_back(make_node<let_rep>(let.var_, operand(val)));
+        } else {
+            // The last let emitted holds the value: rebind it to the user's variable.
+            val->accept(*this);
+            new_lets.back()->is_let()->var_ = let.var_;
+        }
+    }
 };
 
 struct validate : visitor {
+    // Whether to go on to the definitions that follow a function or struct.
+    bool follow_scopes_ = true;
+
     virtual void visit(func_rep& e) override {
         if (!e.body_) {
-            throw std::runtime_error("Function " + e.name_ + " has no body");
+            throw std::runtime_error("Function " + e.name_.str() + " has no body");
         }
         for(auto a: e.args_) {
             if (!a->is_vardef()) {
-                throw std::runtime_error("Function " + e.name_ + " has an invalid argument");
+                throw std::runtime_error("Function " + e.name_.str() + " has an invalid argument");
             }
         }
         if (!e.type()) {
-            throw std::runtime_error("Function " + e.name_ + " has no type");
+            throw std::runtime_error("Function " + e.name_.str() + " has no type");
         }
         if (e.type()->name() != e.name_) {
-            throw std::runtime_error("Mismatch between function " + e.name_ + " name and it's type's name");
+            throw std::runtime_error("Mismatch between function " + e.name_.str() + " name and it's type's name");
         }
         if (!e.type()->is_func()) {
-            throw std::runtime_error("Function " + e.name_ + " has non-function type");
+            throw std::runtime_error("Function " + e.name_.str() + " has non-function type");
         }
         if (!e.type()->is_func()->ret_) {
-            throw std::runtime_error("Function " + e.name_ + " has no return type");
+            throw std::runtime_error("Function " + e.name_.str() + " has no return type");
         }
         if (e.type()->is_func()->args_.size() != e.args_.size()) {
-            throw std::runtime_error("Mismatch between function " + e.name_ + "'s type and it's arguments");
+            throw std::runtime_error("Mismatch between function " + e.name_.str() + "'s type and it's arguments");
         }
 
         e.body_->accept(*this);
-        if (e.scope_) {
+        if (e.scope_ && follow_scopes_) {
             e.scope_->accept(*this);
         }
 
@@ -619,7 +1225,7 @@ struct validate : visitor {
             auto n1 = e.type()->is_func()->args_[i].name;
 
             if (t0 != t1 || n0 != n1) {
-                throw std::runtime_error("Mismatch between function " + e.name_ + "'s type and it's arguments");
+                throw std::runtime_error("Mismatch between function " + e.name_.str() + "'s type and it's arguments");
             }
         }
     }
@@ -627,26 +1233,28 @@ struct validate : visitor {
     virtual void visit(struct_rep& e) override {
         for(auto a: e.fields_) {
             if (!a->is_vardef()) {
-                throw std::runtime_error("Struct " + e.name_ + " has an invalid field");
+                throw std::runtime_error("Struct " + e.name_.str() + " has an invalid field");
             }
         }
         if (!e.type()) {
-            throw std::runtime_error("Struct " + e.name_ + " has no type");
+            throw std::runtime_error("Struct " + e.name_.str() + " has no type");
         }
         if (e.type()->name() != e.name_) {
-            throw std::runtime_error("Mismatch between struct " + e.name_ + " name and it's type's name");
+            throw std::runtime_error("Mismatch between struct " + e.name_.str() + " name and it's type's name");
         }
         if (!e.type()->is_struct()) {
-            throw std::runtime_error("Struct " + e.name_ + " has non-struct type");
+            throw std::runtime_error("Struct " + e.name_.str() + " has non-struct type");
         }
         if (e.type()->is_struct()->fields_.size() != e.fields_.size()) {
-            throw std::runtime_error("Mismatch between struct " + e.name_ + "'s type and it's fields");
+            throw std::runtime_error("Mismatch between struct " + e.name_.str() + "'s type and it's fields");
         }
 
         if (!e.scope_) {
-            throw std::runtime_error("Struct " + e.name_ + " has no associated scope");
+            throw std::runtime_error("Struct " + e.name_.str() + " has no associated scope");
+        }
+        if (follow_scopes_) {
+            e.scope_->accept(*this);
         }
-        e.scope_->accept(*this);
 
         for (auto a:e.fields_) {
             a->accept(*this);
@@ -659,7 +1267,7 @@ struct validate : visitor {
             auto n1 = e.type()->is_struct()->fields_[i].name;
 
             if (t0 != t1 || n0 != n1) {
-                throw std::runtime_error("Mismatch between struct " + e.name_ + "'s type and it's arguments");
+                throw std::runtime_error("Mismatch between struct " + e.name_.str() + "'s type and it's arguments");
             }
         }
     }
@@ -700,20 +1308,29 @@ struct validate : visitor {
     }
 
     virtual void visit(let_rep& e) override {
-        if (!e.type()) {
-            throw std::runtime_error("Let expression has no type");
-        }
-        if (!e.var_->is_vardef()) {
-            throw std::runtime_error("Let expression's variable references non-vardef expression");
-        }
-        if (!e.scope_) {
-            throw std::runtime_error("Let expression has no associated scope");
-        }
-        e.var_->accept(*this);
-        e.val_->accept(*this);
-        e.scope_->accept(*this);
-        if (e.scope_->type() != e.type()) {
-            throw std::runtime_error("Let expression's type is not the same as its scope's type");
+        // Walk the chain iteratively: it is as long as the function.
+        std::vector<let_rep*> lets;
+        ir_expression* s = &e;
+        while (auto l = s->is_let()) {
+            if (!l->type()) {
+                throw std::runtime_error("Let expression has no type");
+            }
+            if (!l->var_->is_vardef()) {
+                throw std::runtime_error("Let expression's variable references non-vardef expression");
+            }
+            if (!l->scope_) {
+                throw std::runtime_error("Let expression has no associated scope");
+            }
+            l->var_->accept(*this);
+            l->val_->accept(*this);
+            lets.push_back(l);
+            s = l->scope_.get();
+        }
+        s->accept(*this);
+        for (auto l: lets) {
+            if (l->scope_->type() != l->type()) {
+                throw std::runtime_error("Let expression's type is not the same as its scope's type");
+            }
         }
     }
 
@@ -738,12 +1355,45 @@ struct validate : visitor {
         }
     }
 
-    virtual void visit(access_rep& e) override {
-        if (!e.type()) {
-            throw std::runtime_error("Access expression has no type");
+    virtual void visit(fma_rep& e) override {
+        if (!e.type() || !e.type()->is_float()) {
+            throw std::runtime_error("Fused multiply-add has no float type");
         }
-        if (!e.var_->is_varref()) {
-            throw std::runtime_error("Cannot access argument of a non-varref expression");
+        for (auto& o: {e.lhs_, e.rhs_, e.addend_}) {
+            o->accept(*this);
+            if (o->type() != e.type()) {
+                throw std::runtime_error("Fused multiply-add has an operand of incompatible type");
+            }
+            if (!(o->is_varref() || o->is_float())) {
+                throw std::runtime_error("Fused multiply-add is not canonical");
+            }
+        }
+    }
+
+    virtual void visit(intrinsic_rep& e) override {
+        if (!e.type() || !e.type()->is_float()) {
+            throw std::runtime_error("Intrinsic " + std::string(intrinsic_name(e.fn_)) + " has no float type");
+        }
+        if (e.args_.size() != intrinsic_arity(e.fn_)) {
+            throw std::runtime_error("Intrinsic " + std::string(intrinsic_name(e.fn_)) + " has the wrong number of args");
+        }
+        for (auto& a: e.args_) {
+            a->accept(*this);
+            if (a->type() != e.type()) {
+                throw std::runtime_error("Intrinsic " + std::string(intrinsic_name(e.fn_)) + " has an arg of incompatible type");
+            }
+            if (!(a->is_varref() || a->is_float())) {
+                throw std::runtime_error("Intrinsic " + std::string(intrinsic_name(e.fn_)) + " is not canonical");
+            }
+        }
+    }
+
+    virtual void visit(access_rep& e) override {
+        if (!e.type()) {
+            throw std::runtime_error("Access expression has no type");
+        }
+        if (!e.var_->is_varref()) {
+            throw std::runtime_error("Cannot access argument of a non-varref expression");
         }
         e.var_->accept(*this);
 
@@ -785,15 +1435,24 @@ struct validate : visitor {
         if (!e.type()) {
             throw std::runtime_error("Apply expression has no type");
         }
-        if (!e.type()->is_func()) {
-            throw std::runtime_error("Apply expression has non-func type");
+        if (!e.func_ || !e.func_->is_func()) {
+            throw std::runtime_error("Apply expression applies a non-func type");
+        }
+        if (!e.callee_ || e.callee_->type() != e.func_) {
+            throw std::runtime_error("Apply expression is not linked to the definition of the applied function");
+        }
+        if (e.type() != e.func_->is_func()->ret_) {
+            throw std::runtime_error("Apply expression's type is not the applied function's return type");
+        }
+        if (e.func_->is_func()->args_.size() != e.args_.size()) {
+            throw std::runtime_error("Apply expression has the wrong number of args");
         }
         for (auto a:e.args_) {
             a->accept(*this);
         }
         for (unsigned i = 0; i < e.args_.size(); ++i) {
             auto t0 = e.args_[i]->type();
-            auto t1 = e.type()->is_func()->args_[i].type;
+            auto t1 = e.func_->is_func()->args_[i].type;
             if (t0 != t1) {
                 throw std::runtime_error("Apply expression has args with incorrect types");
             }
@@ -809,18 +1468,157 @@ struct validate : visitor {
     virtual  void visit(ir_expression& e) override {}
 };
 
-struct constant_prop : visitor {
-    bool prop_ = false;
-    void reset() {
-        prop_ = false;
+// Counts the nodes of a program; references are counted without their definitions.
+struct node_count : visitor {
+    std::size_t count_ = 0;
+
+    void visit(func_rep& e) override {
+        ++count_;
+        for (auto& a: e.args_) a->accept(*this);
+        e.body_->accept(*this);
+        if (e.scope_) e.scope_->accept(*this);
+    }
+
+    void visit(struct_rep& e) override {
+        ++count_;
+        for (auto& f: e.fields_) f->accept(*this);
+        if (e.scope_) e.scope_->accept(*this);
+    }
+
+    void visit(let_rep& e) override {
+        ir_expression* s = &e;
+        while (auto l = s->is_let()) {
+            ++count_;
+            l->var_->accept(*this);
+            l->val_->accept(*this);
+            s = l->scope_.get();
+        }
+        s->accept(*this);
+    }
+
+    void visit(binary_rep& e) override {
+        ++count_;
+        e.lhs_->accept(*this);
+        e.rhs_->accept(*this);
+    }
+
+    void visit(fma_rep& e) override {
+        ++count_;
+        e.lhs_->accept(*this);
+        e.rhs_->accept(*this);
+        e.addend_->accept(*this);
+    }
+
+    void visit(intrinsic_rep& e) override {
+        ++count_;
+        for (auto& a: e.args_) a->accept(*this);
+    }
+
+    void visit(access_rep& e) override {
+        ++count_;
+        e.var_->accept(*this);
+    }
+
+    void visit(create_rep& e) override {
+        ++count_;
+        for (auto& f: e.fields_) f->accept(*this);
+    }
+
+    void visit(apply_rep& e) override {
+        ++count_;
+        for (auto& a: e.args_) a->accept(*this);
+    }
+
+    void visit(ir_expression& e) override {
+        ++count_;
+    }
+};
+
+// Calls `f` on every operand of a canonical let value.
+template <typename F>
+void for_each_operand(const ir_ptr& val, F&& f) {
+    if (val->is_varref()) {
+        f(val);
+    } else if (auto b = val->is_binary()) {
+        f(b->lhs_);
+        f(b->rhs_);
+    } else if (auto m = val->is_fma()) {
+        f(m->lhs_);
+        f(m->rhs_);
+        f(m->addend_);
+    } else if (auto n = val->is_intrinsic()) {
+        for (auto& a: n->args_) f(a);
+    } else if (auto a = val->is_access()) {
+        f(a->var_);
+    } else if (auto c = val->is_create()) {
+        for (auto& a: c->fields_) f(a);
+    } else if (auto a = val->is_apply()) {
+        for (auto& x: a->args_) f(x);
+    }
+}
+
+// Folds a binary operation on literals exactly as the generated code evaluates
+// it: in T, or in the precision `p` of the float type.
+template <typename T>
+T evaluate(operation op, T lhs, T rhs) {
+    switch (op) {
+        case operation::add: return lhs + rhs;
+        case operation::sub: return lhs - rhs;
+        case operation::mul: return lhs * rhs;
+        case operation::div: return lhs / rhs;
+    }
+    return 0;
+}
+
+inline double evaluate(operation op, double lhs, double rhs, precision p) {
+    if (p == precision::f32) {
+        return evaluate<float>(op, lhs, rhs);
+    }
+    return evaluate<double>(op, lhs, rhs);
+}
+
+// Folds a fused multiply-add on literals, with a single rounding.
+template <typename T>
+T evaluate_fma(T lhs, T rhs, T addend, bool negate_product, bool negate_addend) {
+    return std::fma(negate_product? -lhs: lhs, rhs, negate_addend? -addend: addend);
+}
+
+inline double evaluate_fma(const fma_rep& e, double lhs, double rhs, double addend) {
+    if (e.type()->is_float()->precision_ == precision::f32) {
+        return evaluate_fma<float>(lhs, rhs, addend, e.negate_product_, e.negate_addend_);
     }
-    bool propagation_perfromed() {
-        return prop_;
+    return evaluate_fma<double>(lhs, rhs, addend, e.negate_product_, e.negate_addend_);
+}
+
+// Evaluates an intrinsic with the same vmath functions as the batch engine
+// and generated kernels, so folding does not change results.
+template <typename T>
+T evaluate(intrinsic fn, const T* args) {
+    switch (fn) {
+        case intrinsic::exp:     return vmath::exp(args[0]);
+        case intrinsic::log:     return vmath::log(args[0]);
+        case intrinsic::pow:     return vmath::pow(args[0], args[1]);
+        case intrinsic::exprelr: return vmath::exprelr(args[0]);
+    }
+    return 0;
+}
+
+inline double evaluate(const intrinsic_rep& e, const std::vector<double>& args) {
+    if (e.type()->is_float()->precision_ == precision::f32) {
+        std::vector<float> a(args.begin(), args.end());
+        return evaluate<float>(e.fn_, a.data());
     }
-    std::unordered_map<std::string, float> constants;
+    return evaluate<double>(e.fn_, args.data());
+}
 
+// Sparse constant propagation over each function's let-chain. Lets bound to a
+// constant seed a worklist; each one is substituted into the lets that use it,
+// and users that become constant are folded and queued in turn, so a chain of
+// any length folds in time linear in the number of uses. Folding is in the
+// precision of the float type.
+struct constant_prop : visitor {
     void visit(func_rep& e) override {
-        e.body_->accept(*this);
+        propagate(e.body_);
         if(e.scope_) {
             e.scope_->accept(*this);
         }
@@ -832,209 +1630,443 @@ struct constant_prop : visitor {
         }
     }
 
-    void visit(let_rep& e) override {
-        if (e.val_->is_float()) {
-            constants.insert({e.var_->is_vardef()->name_, e.val_->is_float()->val_});
-        }
-        if (auto ref = e.val_->is_varref()) {
-            auto it = constants.find(ref->def_->is_vardef()->name_);
-            if (it != constants.end()) {
-                e.replace_val(std::make_shared<float_rep>(it->second));
-            }
-            constants.insert({e.var_->is_vardef()->name_, e.val_->is_float()->val_});
-        }
-        e.val_->accept(*this);
+    void visit(ir_expression& e) override {}
 
-        if (auto bin = e.val_->is_binary()) {
-            if (bin->lhs_->is_float() && bin->rhs_->is_float()) {
-                auto lhs_val = bin->lhs_->is_float()->val_;
-                auto rhs_val = bin->rhs_->is_float()->val_;
-                float result;
-                switch (bin->op_) {
-                    case operation::add : {
-                        result = lhs_val + rhs_val;
-                        break;
-                    }
-                    case operation::sub : {
-                        result = lhs_val - rhs_val;
-                        break;
-                    }
-                    case operation::mul : {
-                        result = lhs_val * rhs_val;
-                        break;
-                    }
-                    case operation::div : {
-                        result = lhs_val / rhs_val;
-                        break;
+private:
+    std::unordered_map<const ir_expression*, std::vector<let_rep*>> users_; // vardef -> lets using it
+    std::vector<let_rep*> worklist_;
+
+    void propagate(const ir_ptr& body) {
+        users_.clear();
+        worklist_.clear();
+
+        for (auto l = body->is_let(); l; l = l->scope_->is_let()) {
+            if (fold(*l)) {
+                worklist_.push_back(l);
+                continue;
+            }
+            for_each_operand(l->val_, [&](const ir_ptr& o) {
+                if (auto ref = o->is_varref()) {
+                    auto& users = users_[ref->def_.get()];
+                    if (users.empty() || users.back() != l) {
+                        users.push_back(l);
                     }
-                    default: break;
                 }
-                e.replace_val(std::make_shared<float_rep>(result));
-            }
+            });
         }
 
-        e.scope_->accept(*this);
-    }
+        while (!worklist_.empty()) {
+            auto def = worklist_.back();
+            worklist_.pop_back();
 
-    void visit(binary_rep& e) override {
-        if (auto var = e.lhs_->is_varref()) {
-            auto it = constants.find(var->def_->is_vardef()->name_);
-            if (it != constants.end()) {
-                e.replace_lhs(std::make_shared<float_rep>(it->second));
+            auto it = users_.find(def->var_.get());
+            if (it == users_.end()) {
+                continue;
             }
-        }
-        if (auto var = e.rhs_->is_varref()) {
-            auto it = constants.find(var->def_->is_vardef()->name_);
-            if (it != constants.end()) {
-                e.replace_rhs(std::make_shared<float_rep>(it->second));
+            for (auto user: it->second) {
+                substitute(*user, def->var_.get(), def->val_);
+                if (fold(*user)) {
+                    worklist_.push_back(user);
+                }
             }
         }
     }
 
-    void visit(create_rep& e) override {
-        for (unsigned i = 0; i < e.fields_.size(); ++i) {
-            if (auto var = e.fields_[i]->is_varref()) {
-                auto it = constants.find(var->def_->is_vardef()->name_);
-                if (it != constants.end()) {
-                    e.replace_field(i, std::make_shared<float_rep>(it->second));
-                }
+    static bool refers_to(const ir_ptr& e, const ir_expression* def) {
+        auto ref = e->is_varref();
+        return ref && ref->def_.get() == def;
+    }
+
+    // Replaces uses of `def` in `user` with the constant `val`.
+    void substitute(let_rep& user, const ir_expression* def, const ir_ptr& val) {
+        auto& v = user.val_;
+        if (refers_to(v, def)) {
+            user.replace_val(val);
+        } else if (auto b = v->is_binary()) {
+            if (refers_to(b->lhs_, def)) b->replace_lhs(val);
+            if (refers_to(b->rhs_, def)) b->replace_rhs(val);
+        } else if (auto m = v->is_fma()) {
+            if (refers_to(m->lhs_, def)) m->replace_lhs(val);
+            if (refers_to(m->rhs_, def)) m->replace_rhs(val);
+            if (refers_to(m->addend_, def)) m->replace_addend(val);
+        } else if (auto n = v->is_intrinsic()) {
+            for (unsigned i = 0; i < n->args_.size(); ++i) {
+                if (refers_to(n->args_[i], def)) n->replace_arg(i, val);
+            }
+        } else if (auto c = v->is_create()) {
+            for (unsigned i = 0; i < c->fields_.size(); ++i) {
+                if (refers_to(c->fields_[i], def)) c->replace_field(i, val);
+            }
+        } else if (auto a = v->is_apply()) {
+            for (unsigned i = 0; i < a->args_.size(); ++i) {
+                if (refers_to(a->args_[i], def)) a->replace_arg(i, val);
             }
         }
     }
 
-    void visit(apply_rep& e) override {
-        for (unsigned i = 0; i < e.args_.size(); ++i) {
-            if (auto var = e.args_[i]->is_varref()) {
-                auto it = constants.find(var->def_->is_vardef()->name_);
-                if (it != constants.end()) {
-                    e.replace_arg(i, std::make_shared<float_rep>(it->second));
+    // Returns true if `user` is now bound to a constant.
+    static bool fold(let_rep& user) {
+        if (user.val_->is_float()) {
+            return true;
+        }
+        if (auto m = user.val_->is_fma()) {
+            if (!m->lhs_->is_float() || !m->rhs_->is_float() || !m->addend_->is_float()) {
+                return false;
+            }
+            double result = evaluate_fma(*m, m->lhs_->is_float()->val_, m->rhs_->is_float()->val_, m->addend_->is_float()->val_);
+            user.replace_val(make_node<float_rep>(result));
+            return true;
+        }
+        if (auto n = user.val_->is_intrinsic()) {
+            std::vector<double> args;
+            for (auto& a: n->args_) {
+                if (!a->is_float()) {
+                    return false;
                 }
+                args.push_back(a->is_float()->val_);
             }
+            user.replace_val(make_node<float_rep>(evaluate(*n, args)));
+            return true;
         }
+        auto bin = user.val_->is_binary();
+        if (!bin || !bin->lhs_->is_float() || !bin->rhs_->is_float()) {
+            return false;
+        }
+        double result = evaluate(bin->op_, bin->lhs_->is_float()->val_, bin->rhs_->is_float()->val_, bin->type()->is_float()->precision_);
+        user.replace_val(make_node<float_rep>(result));
+        return true;
     }
-
-    void visit(ir_expression& e) override {}
 };
 
-struct unused_variables : visitor {
-    std::unordered_map<std::string, bool> variables_;
-
-    std::set<std::string> unused_set() {
-        std::set<std::string> ret;
-        for (auto a: variables_) {
-            if(!a.second) {
-                ret.insert(a.first);
-            }
-        }
-        return ret;
-    }
+// Rewrites algebraic identities in canonical function bodies, in one pass
+// over every let chain. A value rewritten to a variable or a literal is
+// substituted into its later uses, so rewrites compose.
+//
+// Strict mode only applies rewrites that are exact in IEEE arithmetic:
+//   x*1, 1*x, x/1, x-(+0), x+(-0), (-0)+x  ->  x
+//   literal op literal                     ->  folded
+//   x/c  ->  x*(1/c)                           when c and 1/c are powers of two
+// Fast-math mode assumes finite values and ignores the sign of zero and the
+// rounding of reassociated constants:
+//   x+0, 0+x, x-0  ->  x          x*0, 0*x, x-x  ->  0
+//   x/c  ->  x*(1/c)              x-c  ->  x+(-c)
+//   (x*c1)*c2  ->  x*(c1*c2)      (x+c1)+c2  ->  x+(c1+c2)
+struct simplify : visitor {
+    bool fast_math_;
+    unsigned rewrites_ = 0;
+
+    simplify(bool fast_math = false) : fast_math_(fast_math) {}
 
     void visit(func_rep& e) override {
-        for (auto a: e.args_) {
-            // assume all function variables are used?
-            variables_.insert({a->is_vardef()->name_, true});
-        }
-        e.body_->accept(*this);
-        if(e.scope_) {
+        run(e.body_);
+        if (e.scope_) {
             e.scope_->accept(*this);
         }
     }
 
     void visit(struct_rep& e) override {
-        if(e.scope_) {
+        if (e.scope_) {
             e.scope_->accept(*this);
         }
     }
 
-    void visit(varref_rep& e) override {
-        variables_.at(e.def_->is_vardef()->name_) = true;
-    }
+    void visit(ir_expression& e) override {}
 
-    void visit(vardef_rep& e) override {
-        variables_.insert({e.name_, false});
+private:
+    std::unordered_map<const ir_expression*, ir_ptr> values_;         // vardef -> variable or literal with its value
+    std::unordered_map<const ir_expression*, binary_rep*> binaries_;  // vardef -> binary bound to it
+
+    void run(const ir_ptr& body) {
+        values_.clear();
+        binaries_.clear();
+
+        let_rep* last = nullptr;
+        for (auto l = body->is_let(); l; l = l->scope_->is_let()) {
+            substitute(*l);
+            if (auto b = l->val_->is_binary()) {
+                if (auto r = rewrite(*b)) {
+                    l->replace_val(r);
+                    ++rewrites_;
+                }
+            }
+            if (l->val_->is_varref() || l->val_->is_float()) {
+                values_[l->var_.get()] = l->val_;
+            } else if (auto b = l->val_->is_binary()) {
+                binaries_[l->var_.get()] = b;
+            }
+            last = l;
+        }
+        if (last) {
+            if (auto r = replacement(last->scope_)) {
+                last->set_scope(r);
+            }
+        }
     }
 
-    void visit(let_rep& e) override {
-        e.var_->accept(*this);
-        e.val_->accept(*this);
-        e.scope_->accept(*this);
+    // The operand to use instead of `e`, or null if `e` is unchanged.
+    ir_ptr replacement(const ir_ptr& e) {
+        auto ref = e->is_varref();
+        if (!ref) {
+            return nullptr;
+        }
+        auto it = values_.find(ref->def_.get());
+        if (it == values_.end()) {
+            return nullptr;
+        }
+        if (auto r = it->second->is_varref()) {
+            return make_node<varref_rep>(r->def_, r->type());
+        }
+        return it->second;
     }
 
-    void visit(binary_rep& e) override {
-        e.lhs_->accept(*this);
-        e.rhs_->accept(*this);
+    void substitute(let_rep& l) {
+        auto& v = l.val_;
+        if (auto r = replacement(v)) {
+            l.replace_val(r);
+        } else if (auto b = v->is_binary()) {
+            if (auto r = replacement(b->lhs_)) b->replace_lhs(r);
+            if (auto r = replacement(b->rhs_)) b->replace_rhs(r);
+        } else if (auto m = v->is_fma()) {
+            if (auto r = replacement(m->lhs_)) m->replace_lhs(r);
+            if (auto r = replacement(m->rhs_)) m->replace_rhs(r);
+            if (auto r = replacement(m->addend_)) m->replace_addend(r);
+        } else if (auto n = v->is_intrinsic()) {
+            for (unsigned i = 0; i < n->args_.size(); ++i) {
+                if (auto r = replacement(n->args_[i])) n->replace_arg(i, r);
+            }
+        } else if (auto a = v->is_access()) {
+            if (auto r = replacement(a->var_)) a->var_ = r;
+        } else if (auto c = v->is_create()) {
+            for (unsigned i = 0; i < c->fields_.size(); ++i) {
+                if (auto r = replacement(c->fields_[i])) c->replace_field(i, r);
+            }
+        } else if (auto a = v->is_apply()) {
+            for (unsigned i = 0; i < a->args_.size(); ++i) {
+                if (auto r = replacement(a->args_[i])) a->replace_arg(i, r);
+            }
+        }
     }
 
-    void visit(access_rep& e) override {
-        e.var_->accept(*this);
+    // Returns the simplified value of `b`, or null if there is none.
+    ir_ptr rewrite(binary_rep& b) {
+        double l = 0, r = 0;
+        bool lc = literal(b.lhs_, l);
+        bool rc = literal(b.rhs_, r);
+        auto zero = [&] {return make_node<float_rep>(0.0);};
+        auto p = b.type()->is_float()->precision_;
+
+        if (lc && rc) {
+            return make_node<float_rep>(evaluate(b.op_, l, r, p));
+        }
+        switch (b.op_) {
+            case operation::add: {
+                if (rc && r == 0 && (fast_math_ || std::signbit(r))) return b.lhs_;
+                if (lc && l == 0 && (fast_math_ || std::signbit(l))) return b.rhs_;
+                if (fast_math_ && rc) return reassociate(b.lhs_, r, operation::add);
+                if (fast_math_ && lc) return reassociate(b.rhs_, l, operation::add);
+                break;
+            }
+            case operation::sub: {
+                if (rc && r == 0 && (fast_math_ || !std::signbit(r))) return b.lhs_;
+                if (fast_math_ && same_variable(b.lhs_, b.rhs_)) return zero();
+                if (fast_math_ && rc) {
+                    auto s = reassociate(b.lhs_, -r, operation::add);
+                    return s? s: make_node<binary_rep>(b.lhs_, make_node<float_rep>(-r), operation::add, b.type());
+                }
+                break;
+            }
+            case operation::mul: {
+                if (rc && r == 1) return b.lhs_;
+                if (lc && l == 1) return b.rhs_;
+                if (fast_math_ && ((rc && r == 0) || (lc && l == 0))) return zero();
+                if (fast_math_ && rc) return reassociate(b.lhs_, r, operation::mul);
+                if (fast_math_ && lc) return reassociate(b.rhs_, l, operation::mul);
+                break;
+            }
+            case operation::div: {
+                if (rc && r == 1) return b.lhs_;
+                double inv = evaluate(operation::div, 1.0, r, p);
+                if (rc && (exact_reciprocal(r, inv) || (fast_math_ && std::isfinite(inv) && inv != 0))) {
+                    auto s = fast_math_? reassociate(b.lhs_, inv, operation::mul): nullptr;
+                    return s? s: make_node<binary_rep>(b.lhs_, make_node<float_rep>(inv), operation::mul, b.type());
+                }
+                break;
+            }
+        }
+        return nullptr;
     }
 
-    void visit(create_rep& e) override {
-        for (auto a: e.fields_) {
-            a->accept(*this);
+    // x op c where x = y op c2 becomes y op (c2 op c), for associative `op`;
+    // returns null if x is not of that form.
+    ir_ptr reassociate(const ir_ptr& x, double c, operation op) {
+        auto ref = x->is_varref();
+        if (!ref) {
+            return nullptr;
+        }
+        auto it = binaries_.find(ref->def_.get());
+        if (it == binaries_.end() || it->second->op_ != op) {
+            return nullptr;
         }
+        auto inner = it->second;
+        auto p = inner->type()->is_float()->precision_;
+        double c2 = 0;
+        if (literal(inner->rhs_, c2)) {
+            return make_node<binary_rep>(inner->lhs_, make_node<float_rep>(evaluate(op, c2, c, p)), op, inner->type());
+        }
+        if (literal(inner->lhs_, c2)) {
+            return make_node<binary_rep>(inner->rhs_, make_node<float_rep>(evaluate(op, c2, c, p)), op, inner->type());
+        }
+        return nullptr;
     }
 
-    void visit(apply_rep& e) override {
-        for (auto a: e.args_) {
-            a->accept(*this);
+    static bool literal(const ir_ptr& e, double& val) {
+        if (auto f = e->is_float()) {
+            val = f->val_;
+            return true;
         }
+        return false;
     }
 
-    void visit(ir_expression& e) override {}
+    static bool same_variable(const ir_ptr& a, const ir_ptr& b) {
+        auto ra = a->is_varref();
+        auto rb = b->is_varref();
+        return ra && rb && ra->def_ == rb->def_;
+    }
+
+    // True if c and its rounded reciprocal `inv` are both powers of two.
+    static bool exact_reciprocal(double c, double inv) {
+        int e;
+        return std::abs(std::frexp(c, &e)) == 0.5 && std::abs(std::frexp(inv, &e)) == 0.5;
+    }
 };
 
+// Removes lets whose variable is never used. Every variable's uses are counted
+// once; unused lets are queued, and removing one decrements the counts of its
+// operands, queueing any that drop to zero. The chain is then relinked around
+// the removed lets, so each function is handled in one linear traversal.
 struct eliminate_dead_code : visitor {
-    std::set<std::string> unused_vars_;
-
-    eliminate_dead_code(std::set<std::string> unused_vars) : unused_vars_(unused_vars) {}
+    std::unordered_map<const ir_expression*, unsigned> uses_;  // vardef -> number of uses
+    unsigned removed_ = 0;
 
     void visit(func_rep& e) override {
-        while (remove(e.body_->is_let())) {
-            e.body_ = e.body_->is_let()->scope_;
-        }
-        e.body_->accept(*this);
-
+        e.body_ = eliminate(e.body_);
         if(e.scope_) {
-            while (remove(e.scope_->is_let())) {
-                e.scope_ = e.scope_->is_let()->scope_;
-            }
             e.scope_->accept(*this);
         }
     }
 
     void visit(struct_rep& e) override {
         if (e.scope_) {
-            while (remove(e.scope_->is_let())) {
-                e.scope_ = e.scope_->is_let()->scope_;
-            }
             e.scope_->accept(*this);
         }
     }
 
-    void visit(let_rep& e) override {
-        while (remove(e.scope_->is_let())) {
-            e.scope_ = e.scope_->is_let()->scope_;
-        }
-        e.scope_->accept(*this);
-    }
-
     void visit(ir_expression& e) override {}
 
 private:
-    bool remove(const let_rep* let) {
-        if(!let) {
-            return false;
+    // Returns the head of the chain starting at `body` with dead lets removed.
+    ir_ptr eliminate(const ir_ptr& body) {
+        std::vector<ir_ptr> lets;
+        std::unordered_map<const ir_expression*, let_rep*> defs;
+
+        ir_ptr result = body;
+        for (; result->is_let(); result = result->is_let()->scope_) {
+            lets.push_back(result);
+            defs[result->is_let()->var_.get()] = result->is_let();
+        }
+
+        uses_.clear();
+        auto count = [&](const ir_ptr& o) {
+            if (auto ref = o->is_varref()) {
+                ++uses_[ref->def_.get()];
+            }
+        };
+        for (auto& l: lets) {
+            for_each_operand(l->is_let()->val_, count);
+        }
+        for_each_operand(result, count);
+
+        std::vector<let_rep*> worklist;
+        std::unordered_map<const let_rep*, bool> dead;
+        for (auto& l: lets) {
+            if (!uses_.count(l->is_let()->var_.get())) {
+                worklist.push_back(l->is_let());
+            }
+        }
+        while (!worklist.empty()) {
+            auto l = worklist.back();
+            worklist.pop_back();
+            dead[l] = true;
+
+            for_each_operand(l->val_, [&](const ir_ptr& o) {
+                auto ref = o->is_varref();
+                if (!ref) return;
+                auto it = defs.find(ref->def_.get());
+                if (it != defs.end() && --uses_[ref->def_.get()] == 0) {
+                    worklist.push_back(it->second);
+                }
+            });
+        }
+
+        // Relink the surviving lets, innermost first.
+        for (auto it = lets.rbegin(); it != lets.rend(); ++it) {
+            auto l = (*it)->is_let();
+            if (dead.count(l)) {
+                ++removed_;
+                continue;
+            }
+            l->set_scope(result);
+            result = *it;
         }
-        return unused_vars_.count(let->var_->is_vardef()->name_);
+        return result;
     }
 };
 
+// Value numbering: every let value is reduced to a key made of its operation and
+// its operands' definitions, and looked up in a hash table of the values computed
+// so far in the function. A hit turns the let into a copy of the earlier variable,
+// and copies are renamed away as the chain is walked, so one pass suffices.
 struct eliminate_common_subexpressions : visitor {
-    std::unordered_map<std::string, ir_ptr> rename_map_; // string -> vardef
-    std::vector<std::pair<ir_ptr, ir_ptr>> expressions_; // ir_ptr -> vardef
+    struct operand {
+        bool constant_;
+        std::uintptr_t value_;   // vardef address, or the bits of a constant
+
+        bool operator==(const operand& o) const {
+            return constant_ == o.constant_ && value_ == o.value_;
+        }
+        bool operator<(const operand& o) const {
+            return constant_ != o.constant_? constant_ < o.constant_: value_ < o.value_;
+        }
+    };
+
+    struct value_key {
+        enum kind {constant, binary, fma, intrinsic, access, create, apply};
+
+        kind kind_;
+        std::uintptr_t tag_;     // operation, fma signs, intrinsic, field index or type
+        std::vector<operand> operands_;
+
+        bool operator==(const value_key& o) const {
+            return kind_ == o.kind_ && tag_ == o.tag_ && operands_ == o.operands_;
+        }
+    };
+
+    struct value_hash {
+        std::size_t operator()(const value_key& k) const {
+            std::size_t h = std::hash<std::uintptr_t>()(k.tag_) * 31 + k.kind_;
+            for (auto& o: k.operands_) {
+                h = (h ^ std::hash<std::uintptr_t>()(o.value_)) * 1099511628211ull + o.constant_;
+            }
+            return h;
+        }
+    };
+
+    std::unordered_map<value_key, ir_ptr, value_hash> values_;         // value -> vardef
+    std::unordered_map<const ir_expression*, ir_ptr> rename_map_;      // vardef -> vardef
 
     void visit(func_rep& e) override {
+        // Variables of one function are not in scope in the next.
+        values_.clear();
         e.body_->accept(*this);
         if(e.scope_) {
             e.scope_->accept(*this);
@@ -1046,26 +2078,20 @@ struct eliminate_common_subexpressions : visitor {
     }
 
     void visit(varref_rep& e) override {
-        if (rename_map_.count(e.def_->is_vardef()->name_)) {
-            auto new_def = rename_map_.at(e.def_->is_vardef()->name_);
-            e.def_ = new_def;
+        auto it = rename_map_.find(e.def_.get());
+        if (it != rename_map_.end()) {
+            e.def_ = it->second;
         }
     }
 
     void visit(let_rep& e) override {
-        e.val_->accept(*this);
-        for (auto& a: expressions_) {
-            auto exp = a.first;
-            auto matching_def = a.second;
-            if (compare(exp, e.val_)) {
-                rename_map_[e.var_->is_vardef()->name_] = matching_def;
-                e.val_ = std::make_shared<varref_rep>(matching_def, matching_def->type());
-                e.scope_->accept(*this);
-                return;
-            }
+        // Walk the chain iteratively: it is as long as the function.
+        ir_expression* s = &e;
+        while (auto l = s->is_let()) {
+            number(*l);
+            s = l->scope_.get();
         }
-        expressions_.push_back({e.val_, e.var_});
-        e.scope_->accept(*this);
+        s->accept(*this);
     }
 
     void visit(binary_rep& e) override {
@@ -1073,6 +2099,18 @@ struct eliminate_common_subexpressions : visitor {
         e.rhs_->accept(*this);
     }
 
+    void visit(fma_rep& e) override {
+        e.lhs_->accept(*this);
+        e.rhs_->accept(*this);
+        e.addend_->accept(*this);
+    }
+
+    void visit(intrinsic_rep& e) override {
+        for (auto& a:e.args_) {
+            a->accept(*this);
+        }
+    }
+
     void visit(access_rep& e) override {
         e.var_->accept(*this);
     }
@@ -1092,107 +2130,503 @@ struct eliminate_common_subexpressions : visitor {
     void visit(ir_expression& e) override {}
 
 private:
-    bool compare(ir_ptr e0, ir_ptr e1) {
-        if (e0->is_float() && e1->is_float()) {
-            if (e0->is_float()->val_ == e1->is_float()->val_) {
-                return true;
+    void number(let_rep& e) {
+        e.val_->accept(*this);
+
+        // Copies are propagated: later uses refer to the original variable.
+        if (auto ref = e.val_->is_varref()) {
+            rename_map_[e.var_.get()] = ref->def_;
+            return;
+        }
+
+        auto key = value_of(e.val_);
+        auto it = values_.find(key);
+        if (it != values_.end()) {
+            auto matching_def = it->second;
+            rename_map_[e.var_.get()] = matching_def;
+            e.val_ = make_node<varref_rep>(matching_def, matching_def->type());
+        } else {
+            values_.insert({std::move(key), e.var_});
+        }
+    }
+
+    static operand operand_of(const ir_ptr& e) {
+        if (auto f = e->is_float()) {
+            std::uint64_t bits;
+            std::memcpy(&bits, &f->val_, sizeof(bits));
+            return {true, (std::uintptr_t)bits};
+        }
+        return {false, (std::uintptr_t)e->is_varref()->def_.get()};
+    }
+
+    static value_key value_of(const ir_ptr& e) {
+        if (e->is_float()) {
+            return {value_key::constant, 0, {operand_of(e)}};
+        }
+        if (auto b = e->is_binary()) {
+            auto lhs = operand_of(b->lhs_);
+            auto rhs = operand_of(b->rhs_);
+            bool commutative = b->op_ == operation::add || b->op_ == operation::mul;
+            if (commutative && rhs < lhs) {
+                std::swap(lhs, rhs);
             }
-            return false;
+            return {value_key::binary, (std::uintptr_t)b->op_, {lhs, rhs}};
         }
-        if (e0->is_varref() && e1->is_varref()) {
-            if (e0->is_varref()->def_->is_vardef()->name_ ==
-                e1->is_varref()->def_->is_vardef()->name_) {
-                return true;
+        if (auto m = e->is_fma()) {
+            auto lhs = operand_of(m->lhs_);
+            auto rhs = operand_of(m->rhs_);
+            if (rhs < lhs) {
+                std::swap(lhs, rhs);
             }
-            return false;
+            return {value_key::fma, (std::uintptr_t)(m->negate_product_ + 2*m->negate_addend_), {lhs, rhs, operand_of(m->addend_)}};
         }
-        if (e0->is_binary() && e1->is_binary()) {
-            if (e0->is_binary()->op_ != e1->is_binary()->op_) {
-                return false;
+        if (auto n = e->is_intrinsic()) {
+            value_key k = {value_key::intrinsic, (std::uintptr_t)n->fn_, {}};
+            for (auto& a: n->args_) {
+                k.operands_.push_back(operand_of(a));
+            }
+            return k;
+        }
+        if (auto a = e->is_access()) {
+            return {value_key::access, a->index_, {operand_of(a->var_)}};
+        }
+        if (auto c = e->is_create()) {
+            value_key k = {value_key::create, (std::uintptr_t)c->type().get(), {}};
+            for (auto& f: c->fields_) {
+                k.operands_.push_back(operand_of(f));
+            }
+            return k;
+        }
+        if (auto a = e->is_apply()) {
+            value_key k = {value_key::apply, (std::uintptr_t)a->func_.get(), {}};
+            for (auto& f: a->args_) {
+                k.operands_.push_back(operand_of(f));
+            }
+            return k;
+        }
+        throw std::runtime_error("Cannot number a non-canonical let value");
+    }
+};
+
+// Copies the let values of canonical bodies. A variable operand is replaced
+// by the operand its definition maps to in `values_`; literals are shared
+// unless `copy_literals_` is set. A copied call gets the callee chosen by
+// `callee_`, or keeps its own.
+struct value_copier {
+    std::unordered_map<const ir_expression*, ir_ptr> values_;   // vardef -> operand in the copy
+    std::function<func_rep*(const apply_rep&)>       callee_;
+    bool                                             copy_literals_ = false;
+
+    ir_ptr copy(const ir_ptr& v) {
+        if (v->is_float() || v->is_varref()) {
+            return operand(v);
+        }
+        if (auto b = v->is_binary()) {
+            return make_node<binary_rep>(operand(b->lhs_), operand(b->rhs_), b->op_, b->type());
+        }
+        if (auto m = v->is_fma()) {
+            return make_node<fma_rep>(operand(m->lhs_), operand(m->rhs_), operand(m->addend_), m->negate_product_, m->negate_addend_, m->type());
+        }
+        if (auto n = v->is_intrinsic()) {
+            std::vector<ir_ptr> args;
+            for (auto& x: n->args_) {
+                args.push_back(operand(x));
             }
+            return make_node<intrinsic_rep>(n->fn_, args, n->type());
+        }
+        if (auto a = v->is_access()) {
+            return make_node<access_rep>(operand(a->var_), a->index_, a->type());
+        }
+        if (auto c = v->is_create()) {
+            std::vector<ir_ptr> fields;
+            for (auto& f: c->fields_) {
+                fields.push_back(operand(f));
+            }
+            return make_node<create_rep>(fields, c->type());
+        }
+        if (auto a = v->is_apply()) {
+            std::vector<ir_ptr> args;
+            for (auto& x: a->args_) {
+                args.push_back(operand(x));
+            }
+            return make_node<apply_rep>(args, a->func_, callee_? callee_(*a): a->callee_);
+        }
+        throw std::runtime_error("Cannot copy a non-canonical let value");
+    }
+
+    // The operand that replaces `e` in the copy.
+    ir_ptr operand(const ir_ptr& e) {
+        auto ref = e->is_varref();
+        if (!ref) {
+            auto f = e->is_float();
+            return f && copy_literals_? make_node<float_rep>(f->val_): e;
+        }
+        auto v = values_.at(ref->def_.get());
+        if (auto r = v->is_varref()) {
+            return make_node<varref_rep>(r->def_, r->type());
+        }
+        return v;
+    }
+};
+
+// A canonical function's arguments and body copied with fresh variables of
+// the same names, so that passes can change the copy and the original
+// independently. The copy shares no nodes with the original, so it may be
+// allocated from storage that outlives it. `callee` relinks the copied calls,
+// for a copy that goes into another program.
+struct function_copy {
+    std::vector<ir_ptr> args_;
+    ir_ptr              body_;
+};
+
+inline function_copy copy_function(const std::vector<ir_ptr>& args, const ir_ptr& body, std::function<func_rep*(const apply_rep&)> callee = {}) {
+    function_copy result;
+    value_copier copier;
+    copier.callee_ = std::move(callee);
+    copier.copy_literals_ = true;
+    for (auto& a: args) {
+        auto var = make_node<vardef_rep>(a->is_vardef()->name_, a->type());
+        copier.values_[a.get()] = make_node<varref_rep>(var, var->type());
+        result.args_.push_back(var);
+    }
+
+    let_rep* last = nullptr;
+    auto e = body;
+    for (; e->is_let(); e = e->is_let()->scope_) {
+        auto l = e->is_let();
+        auto var = make_node<vardef_rep>(l->var_->is_vardef()->name_, l->var_->type());
+        auto copy = make_node<let_rep>(var, copier.copy(l->val_), nullptr, l->type());
+        copier.values_[l->var_.get()] = make_node<varref_rep>(var, var->type());
+        if (last) {
+            last->set_scope(copy);
+        } else {
+            result.body_ = copy;
+        }
+        last = copy.get();
+    }
+    auto tail = copier.copy(e);
+    if (last) {
+        last->set_scope(tail);
+    } else {
+        result.body_ = tail;
+    }
+    return result;
+}
+
+// Replaces calls in canonical function bodies with copies of the callee's let
+// chain. The copied lets get fresh variables, named apart from every variable
+// of the caller, and the call's let is left holding the callee's result.
+//
+// A call is inlined if its callee has at most `max_size_` lets, and only while
+// the caller stays within `max_growth_` times its original number of lets (plus
+// one callee). Functions are handled in definition order, so callees have
+// already had their own calls inlined.
+struct inline_calls : visitor {
+    unsigned max_size_;
+    unsigned max_growth_;
+    unsigned inlined_ = 0;
+
+    inline_calls(unsigned max_size = 32, unsigned max_growth = 4) : max_size_(max_size), max_growth_(max_growth) {}
+
+    void visit(func_rep& e) override {
+        run(e);
+        if (e.scope_) {
+            e.scope_->accept(*this);
+        }
+    }
+
+    void visit(struct_rep& e) override {
+        if (e.scope_) {
+            e.scope_->accept(*this);
+        }
+    }
+
+    void visit(ir_expression& e) override {}
 
-            auto lhs0 = e0->is_binary()->lhs_;
-            auto rhs0 = e0->is_binary()->rhs_;
-            auto lhs1 = e1->is_binary()->lhs_;
-            auto rhs1 = e1->is_binary()->rhs_;
+private:
+    std::unordered_set<symbol> used_;                                 // names of the caller's variables
+    value_copier copier_;                                             // callee vardef -> operand in the caller
+    unsigned var_idx_ = 0;
 
-            bool lhs_match = false;
-            if ((lhs0->is_varref() && lhs1->is_varref()) &&
-                (lhs0->is_varref()->def_->is_vardef()->name_ == lhs1->is_varref()->def_->is_vardef()->name_)) {
-                lhs_match = true;
-            } else
-            if ((lhs0->is_float() && lhs1->is_float()) &&
-                  (lhs0->is_float()->val_ == lhs1->is_float()->val_)) {
-                lhs_match = true;
+    void run(func_rep& f) {
+        used_.clear();
+        var_idx_ = 0;
+        for (auto& a: f.args_) {
+            used_.insert(a->is_vardef()->name_);
+        }
+        std::size_t size = 0;
+        for (auto l = f.body_->is_let(); l; l = l->scope_->is_let()) {
+            used_.insert(l->var_->is_vardef()->name_);
+            ++size;
+        }
+        auto budget = size*max_growth_ + max_size_;
+
+        let_rep* prev = nullptr;
+        for (auto l = f.body_; l->is_let(); l = l->is_let()->scope_) {
+            auto let = l->is_let();
+            auto call = let->val_->is_apply();
+            auto callee = call? call->callee_: nullptr;
+            std::size_t n = callee && callee != &f? length(callee->body_): max_size_+1;
+            if (n > max_size_ || size + n > budget) {
+                prev = let;
+                continue;
             }
 
-            bool rhs_match = false;
-            if ((rhs0->is_varref() && rhs1->is_varref()) &&
-                (rhs0->is_varref()->def_->is_vardef()->name_ == rhs1->is_varref()->def_->is_vardef()->name_)) {
-                rhs_match = true;
-            } else
-            if ((rhs0->is_float() && rhs1->is_float()) &&
-                (rhs0->is_float()->val_ == rhs1->is_float()->val_)) {
-                rhs_match = true;
+            // Splice the copied lets in before `let`.
+            auto first = splice(*call, *callee, l, let->type());
+            if (prev) {
+                prev->set_scope(first);
+            } else {
+                f.set_body(first);
             }
-            return lhs_match && rhs_match;
+            size += n;
+            ++inlined_;
+            prev = let;
+        }
+    }
+
+    // Number of lets in a chain, counting no further than max_size_+1.
+    std::size_t length(const ir_ptr& body) const {
+        std::size_t n = 0;
+        for (auto l = body->is_let(); l && n <= max_size_; l = l->scope_->is_let()) {
+            ++n;
         }
-        if (e0->is_access() && e1->is_access()) {
-            if ((e0->is_access()->var_->is_varref()->def_->is_vardef()->name_ ==
-                 e1->is_access()->var_->is_varref()->def_->is_vardef()->name_) &&
-                (e0->is_access()->index_ == e1->is_access()->index_)) {
-                return true;
+        return n;
+    }
+
+    // Copies the body of `callee` in front of `next`, the let bound to `call`,
+    // and makes that let a copy of the result. Returns the first copied let.
+    ir_ptr splice(apply_rep& call, func_rep& callee, const ir_ptr& next, type_ptr type) {
+        copier_.values_.clear();
+        for (unsigned i = 0; i < callee.args_.size(); ++i) {
+            copier_.values_[callee.args_[i].get()] = call.args_[i];
+        }
+
+        ir_ptr first = next;
+        let_rep* last = nullptr;
+        auto e = callee.body_;
+        for (; e->is_let(); e = e->is_let()->scope_) {
+            auto l = e->is_let();
+            auto var = make_node<vardef_rep>(fresh_name(), l->var_->type());
+            auto copy = make_node<let_rep>(var, copier_.copy(l->val_), next, type);
+            copier_.values_[l->var_.get()] = make_node<varref_rep>(var, var->type());
+            if (last) {
+                last->set_scope(copy);
+            } else {
+                first = copy;
             }
-            return false;
+            last = copy.get();
         }
-        if (e0->is_create() && e1->is_create()) {
-            if (e0->is_create()->type() == e1->is_create()->type()) {
-                auto& f0 = e0->is_create()->fields_;
-                auto& f1 = e1->is_create()->fields_;
+        next->is_let()->replace_val(copier_.operand(e));
+        return first;
+    }
 
-                for (unsigned i = 0; i < f0.size(); i++) {
-                    bool match = false;
-                    if ((f0[i]->is_float() && f1[i]->is_float()) &&
-                        (f0[i]->is_float()->val_ == f1[i]->is_float()->val_)) {
-                        match = true;
-                    }
-                    if ((f0[i]->is_varref() && f1[i]->is_varref()) &&
-                        (f0[i]->is_varref()->def_->is_vardef()->name_ == f1[i]->is_varref()->def_->is_vardef()->name_)) {
-                        match = true;
-                    }
-                    if(!match) {
-                        return false;
-                    }
+    symbol fresh_name() {
+        symbol name;
+        do {
+            name = "_il" + std::to_string(var_idx_++);
+        } while (used_.count(name));
+        used_.insert(name);
+        return name;
+    }
+};
+
+// Scalar replacement of structs created in canonical function bodies. A read
+// of a field of a struct created (or copied from one created) earlier in the
+// same function is replaced by the field's value, and creates and copies left
+// without uses are then removed. Struct arguments and call results are kept.
+struct scalar_replacement : visitor {
+    unsigned forwarded_ = 0;
+    unsigned removed_   = 0;
+
+    void visit(func_rep& e) override {
+        run(e);
+        if (e.scope_) {
+            e.scope_->accept(*this);
+        }
+    }
+
+    void visit(struct_rep& e) override {
+        if (e.scope_) {
+            e.scope_->accept(*this);
+        }
+    }
+
+    void visit(ir_expression& e) override {}
+
+private:
+    std::unordered_map<const ir_expression*, create_rep*> creates_;  // vardef -> create holding its value
+    std::unordered_map<const ir_expression*, unsigned> uses_;        // vardef -> number of uses
+
+    void run(func_rep& f) {
+        creates_.clear();
+        uses_.clear();
+
+        std::vector<let_rep*> lets;
+        for (auto l = f.body_->is_let(); l; l = l->scope_->is_let()) {
+            if (auto a = l->val_->is_access()) {
+                if (auto c = created(a->var_)) {
+                    auto& field = c->fields_[a->index_];
+                    auto ref = field->is_varref();
+                    l->replace_val(ref? make_node<varref_rep>(ref->def_, ref->type()): field);
+                    ++forwarded_;
                 }
-                return true;
             }
-            return false;
+            if (auto c = l->val_->is_create()) {
+                creates_[l->var_.get()] = c;
+            } else if (auto c = created(l->val_)) {
+                creates_[l->var_.get()] = c;
+            }
+            for_each_operand(l->val_, [&](const ir_ptr& o) {count(o, 1);});
+            lets.push_back(l);
+        }
+        ir_ptr tail = lets.empty()? f.body_: lets.back()->scope_;
+        for_each_operand(tail, [&](const ir_ptr& o) {count(o, 1);});
+
+        // Remove unused creates and struct copies, last first, so that removing
+        // one can leave the copies and creates it uses unused in turn.
+        std::vector<bool> dead(lets.size(), false);
+        for (auto i = lets.size(); i-- > 0;) {
+            auto l = lets[i];
+            bool aggregate = l->val_->is_create() || (l->val_->is_varref() && creates_.count(l->var_.get()));
+            if (aggregate && !uses_.count(l->var_.get())) {
+                for_each_operand(l->val_, [&](const ir_ptr& o) {count(o, -1);});
+                dead[i] = true;
+                ++removed_;
+            }
         }
-        if (e0->is_apply() && e1->is_apply()) {
-            if (e0->is_apply()->type() == e1->is_apply()->type()) {
-                auto& f0 = e0->is_apply()->args_;
-                auto& f1 = e1->is_apply()->args_;
 
-                for (unsigned i = 0; i < f0.size(); i++) {
-                    bool match = false;
-                    if ((f0[i]->is_float() && f1[i]->is_float()) &&
-                        (f0[i]->is_float()->val_ == f1[i]->is_float()->val_)) {
-                        match = true;
-                    }
-                    if ((f0[i]->is_varref() && f1[i]->is_varref()) &&
-                        (f0[i]->is_varref()->def_->is_vardef()->name_ == f1[i]->is_varref()->def_->is_vardef()->name_)) {
-                        match = true;
-                    }
-                    if(!match) {
-                        return false;
-                    }
+        ir_ptr* link = &f.body_;
+        for (unsigned i = 0; i < lets.size(); ++i) {
+            if (dead[i]) {
+                *link = lets[i]->scope_;
+            } else {
+                link = &lets[i]->scope_;
+            }
+        }
+    }
+
+    // The create holding the value of operand `e`, if it is known.
+    create_rep* created(const ir_ptr& e) const {
+        auto ref = e->is_varref();
+        if (!ref) {
+            return nullptr;
+        }
+        auto it = creates_.find(ref->def_.get());
+        return it == creates_.end()? nullptr: it->second;
+    }
+
+    void count(const ir_ptr& o, int delta) {
+        auto ref = o->is_varref();
+        if (!ref) {
+            return;
+        }
+        auto it = uses_.insert({ref->def_.get(), 0}).first;
+        if ((it->second += delta) == 0) {
+            uses_.erase(it);
+        }
+    }
+};
+
+// Contracts multiplications into the additions and subtractions that use them,
+// in canonical function bodies. A product is fused only if it has no other use,
+// so that it is not computed twice, and its let is then removed:
+//   t = a*b; t+c, c+t  ->  fma(a, b, c)
+//   t = a*b; t-c       ->  fma(a, b, -c)
+//   t = a*b; c-t       ->  fma(-a, b, c)
+// The fused value is rounded once instead of twice, so results may differ
+// from the uncontracted program in the last bit.
+struct contract_fma : visitor {
+    unsigned fused_ = 0;
+
+    void visit(func_rep& e) override {
+        run(e);
+        if (e.scope_) {
+            e.scope_->accept(*this);
+        }
+    }
+
+    void visit(struct_rep& e) override {
+        if (e.scope_) {
+            e.scope_->accept(*this);
+        }
+    }
+
+    void visit(ir_expression& e) override {}
+
+private:
+    std::unordered_map<const ir_expression*, unsigned> products_;  // vardef -> index of the let of its product
+    std::unordered_map<const ir_expression*, unsigned> uses_;      // vardef -> number of uses
+
+    void run(func_rep& f) {
+        products_.clear();
+        uses_.clear();
+
+        std::vector<let_rep*> lets;
+        for (auto l = f.body_->is_let(); l; l = l->scope_->is_let()) {
+            if (auto b = l->val_->is_binary()) {
+                if (b->op_ == operation::mul) {
+                    products_[l->var_.get()] = lets.size();
                 }
-                return true;
             }
-            return false;
+            for_each_operand(l->val_, [&](const ir_ptr& o) {count(o);});
+            lets.push_back(l);
         }
+        ir_ptr tail = lets.empty()? f.body_: lets.back()->scope_;
+        for_each_operand(tail, [&](const ir_ptr& o) {count(o);});
 
-        return false;
-    };
+        std::vector<bool> dead(lets.size(), false);
+        for (auto l: lets) {
+            auto b = l->val_->is_binary();
+            if (!b || (b->op_ != operation::add && b->op_ != operation::sub)) {
+                continue;
+            }
+            bool sub = b->op_ == operation::sub;
+            int i = product(b->lhs_);
+            bool negate_product = false, negate_addend = sub;
+            auto addend = b->rhs_;
+            if (i < 0) {
+                i = product(b->rhs_);
+                negate_product = sub;
+                negate_addend = false;
+                addend = b->lhs_;
+            }
+            if (i < 0) {
+                continue;
+            }
+            auto m = lets[i]->val_->is_binary();
+            l->replace_val(make_node<fma_rep>(m->lhs_, m->rhs_, addend, negate_product, negate_addend, b->type()));
+            dead[i] = true;
+            ++fused_;
+        }
+
+        ir_ptr* link = &f.body_;
+        for (unsigned i = 0; i < lets.size(); ++i) {
+            if (dead[i]) {
+                *link = lets[i]->scope_;
+            } else {
+                link = &lets[i]->scope_;
+            }
+        }
+    }
+
+    // The index of the let of the single-use product `e` refers to, or -1.
+    int product(const ir_ptr& e) const {
+        auto ref = e->is_varref();
+        if (!ref) {
+            return -1;
+        }
+        auto it = products_.find(ref->def_.get());
+        if (it == products_.end() || uses_.at(ref->def_.get()) != 1) {
+            return -1;
+        }
+        return it->second;
+    }
+
+    void count(const ir_ptr& o) {
+        if (auto ref = o->is_varref()) {
+            ++uses_[ref->def_.get()];
+        }
+    }
 };
-}; //namespace ir
\ No newline at end of file
+}; //namespace ir
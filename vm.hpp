@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "evaluate.hpp"
+
+// The VM dispatches with computed gotos where the compiler supports them
+// (GCC and Clang), and with a switch in a loop elsewhere or when
+// ARB_VM_SWITCH_DISPATCH is defined.
+#if defined(__GNUC__) && !defined(ARB_VM_SWITCH_DISPATCH)
+#define ARB_VM_THREADED 1
+#endif
+
+namespace ir {
+
+enum class vm_op : std::uint8_t {
+    add, sub, mul, div,         // d = a op b
+    fma, fms, fnma, fnms,       // d = a*b + c, a*b - c, -a*b + c, -a*b - c, rounded once
+    exp, log, pow, exprelr,     // d = fn(a) or fn(a, b)
+    ret
+};
+
+struct vm_instruction {
+    vm_op         op_;
+    std::uint32_t dst_, a_, b_, c_;
+};
+
+// A function body lowered to register bytecode, for evaluating instances one
+// at a time or a few lanes at a time without a compiler at run time.
+// Registers [0, num_inputs_) hold the arguments, in argument order, and the
+// next constants_.size() registers the literals; the rest are temporaries,
+// assigned by liveness (see allocate_slots).
+// Every instruction computes one let; accesses, creates and calls cost nothing.
+struct vm_program {
+    static constexpr std::size_t batch = 8;   // lanes evaluated together by run
+
+    unsigned num_inputs_    = 0;
+    unsigned num_registers_ = 0;
+    precision precision_    = precision::f64;
+    std::vector<double>         constants_;
+    std::vector<vm_instruction> code_;      // ends with ret
+    std::vector<std::uint32_t>  outputs_;   // register of every result column
+
+    unsigned num_outputs() const {
+        return outputs_.size();
+    }
+
+    // Evaluate `n` instances, with the same columns as batch_kernel::run:
+    // `batch` lanes at a time, then one instance at a time for the rest.
+    template <typename T>
+    void run(std::size_t n, const T* const* in, T* const* out) const {
+        if (precision_ != (sizeof(T) == sizeof(float)? precision::f32: precision::f64)) {
+            throw std::runtime_error("Cannot run VM program: columns do not match the program's precision");
+        }
+        auto wide = registers<T>(batch);
+        auto narrow = registers<T>(1);
+
+        std::size_t i = 0;
+        for (; i + batch <= n; i += batch) {
+            lanes<batch>(i, in, out, wide.data());
+        }
+        for (; i < n; ++i) {
+            lanes<1>(i, in, out, narrow.data());
+        }
+    }
+
+    // Evaluate one instance: `args` holds the num_inputs_ argument values
+    // and `results` receives the num_outputs() result values. `regs` must
+    // hold num_registers_ values, initialized by registers<T>(1).
+    template <typename T>
+    void run_one(const T* args, T* results, T* regs) const {
+        std::copy(args, args + num_inputs_, regs);
+        execute<1>(regs);
+        for (unsigned i = 0; i < outputs_.size(); ++i) {
+            results[i] = regs[outputs_[i]];
+        }
+    }
+
+    // A register file for `width` lanes, with the constants loaded.
+    template <typename T>
+    std::vector<T> registers(std::size_t width) const {
+        std::vector<T> regs((std::size_t)num_registers_*width);
+        for (unsigned i = 0; i < constants_.size(); ++i) {
+            std::fill_n(regs.data() + (std::size_t)(num_inputs_ + i)*width, width, (T)constants_[i]);
+        }
+        return regs;
+    }
+
+private:
+    template <std::size_t L, typename T>
+    void lanes(std::size_t first, const T* const* in, T* const* out, T* regs) const {
+        for (unsigned i = 0; i < num_inputs_; ++i) {
+            std::copy(in[i] + first, in[i] + first + L, regs + (std::size_t)i*L);
+        }
+        execute<L>(regs);
+        for (unsigned i = 0; i < outputs_.size(); ++i) {
+            std::copy(regs + (std::size_t)outputs_[i]*L, regs + (std::size_t)outputs_[i]*L + L, out[i] + first);
+        }
+    }
+
+    // Runs the code on L lanes; register r is regs[r*L, r*L + L).
+    template <std::size_t L, typename T>
+    void execute(T* regs) const {
+        const vm_instruction* pc = code_.data();
+        T* d;
+        const T *a, *b, *c;
+
+#define ARB_VM_OPERANDS d = regs + (std::size_t)pc->dst_*L; a = regs + (std::size_t)pc->a_*L; b = regs + (std::size_t)pc->b_*L; c = regs + (std::size_t)pc->c_*L
+#define ARB_VM_LANES(expr) ARB_VM_OPERANDS; for (std::size_t k = 0; k < L; ++k) d[k] = expr
+
+#ifdef ARB_VM_THREADED
+        static const void* labels[] = {
+            &&op_add, &&op_sub, &&op_mul, &&op_div,
+            &&op_fma, &&op_fms, &&op_fnma, &&op_fnms,
+            &&op_exp, &&op_log, &&op_pow, &&op_exprelr,
+            &&op_ret};
+#define ARB_VM_CASE(op) op_##op
+#define ARB_VM_NEXT goto *labels[(unsigned)(++pc)->op_]
+        goto *labels[(unsigned)pc->op_];
+        {
+#else
+#define ARB_VM_CASE(op) case vm_op::op
+#define ARB_VM_NEXT ++pc; continue
+        for (;;) switch (pc->op_) {
+#endif
+        ARB_VM_CASE(add):     ARB_VM_LANES(a[k] + b[k]);                      ARB_VM_NEXT;
+        ARB_VM_CASE(sub):     ARB_VM_LANES(a[k] - b[k]);                      ARB_VM_NEXT;
+        ARB_VM_CASE(mul):     ARB_VM_LANES(a[k] * b[k]);                      ARB_VM_NEXT;
+        ARB_VM_CASE(div):     ARB_VM_LANES(a[k] / b[k]);                      ARB_VM_NEXT;
+        ARB_VM_CASE(fma):     ARB_VM_LANES(std::fma(a[k], b[k], c[k]));       ARB_VM_NEXT;
+        ARB_VM_CASE(fms):     ARB_VM_LANES(std::fma(a[k], b[k], -c[k]));      ARB_VM_NEXT;
+        ARB_VM_CASE(fnma):    ARB_VM_LANES(std::fma(-a[k], b[k], c[k]));      ARB_VM_NEXT;
+        ARB_VM_CASE(fnms):    ARB_VM_LANES(std::fma(-a[k], b[k], -c[k]));     ARB_VM_NEXT;
+        ARB_VM_CASE(exp):     ARB_VM_LANES(vmath::exp(a[k]));                 ARB_VM_NEXT;
+        ARB_VM_CASE(log):     ARB_VM_LANES(vmath::log(a[k]));                 ARB_VM_NEXT;
+        ARB_VM_CASE(pow):     ARB_VM_LANES(vmath::pow(a[k], b[k]));           ARB_VM_NEXT;
+        ARB_VM_CASE(exprelr): ARB_VM_LANES(vmath::exprelr(a[k]));             ARB_VM_NEXT;
+        ARB_VM_CASE(ret):     return;
+        }
+
+#undef ARB_VM_OPERANDS
+#undef ARB_VM_LANES
+#undef ARB_VM_CASE
+#undef ARB_VM_NEXT
+    }
+};
+
+// Lowers a function to VM bytecode, by way of its batch kernel. Constants
+// become constant registers; the temporaries get registers from
+// allocate_slots, so the register file is as small as the largest set of
+// temporaries live at once.
+struct vm_compiler {
+    ir_ptr program_;
+
+    vm_compiler(const ir_ptr& program) : program_(program) {}
+
+    vm_program compile(const std::string& name) {
+        auto k = batch_compiler(program_).compile(name);
+        allocate_slots(k, true);
+
+        vm_program p;
+        p.num_inputs_ = k.num_inputs_;
+        p.num_registers_ = k.num_inputs_ + k.num_temps_;
+        p.precision_ = k.precision_;
+        p.outputs_.assign(k.outputs_.begin(), k.outputs_.end());
+        for (auto& c: k.code_) {
+            if (c.kind_ == batch_instruction::constant) {
+                p.constants_.push_back(c.val_);
+            } else {
+                p.code_.push_back({op(c), c.dst_, c.lhs_, c.rhs_, c.aux_});
+            }
+        }
+        p.code_.push_back({vm_op::ret, 0, 0, 0, 0});
+        return p;
+    }
+
+private:
+    static vm_op op(const batch_instruction& c) {
+        switch (c.kind_) {
+            case batch_instruction::binary: {
+                vm_op ops[] = {vm_op::add, vm_op::sub, vm_op::mul, vm_op::div};
+                return ops[(unsigned)c.op_];
+            }
+            case batch_instruction::fma: {
+                vm_op ops[2][2] = {{vm_op::fma, vm_op::fms}, {vm_op::fnma, vm_op::fnms}};
+                return ops[c.negate_product_][c.negate_addend_];
+            }
+            case batch_instruction::intrinsic: {
+                vm_op ops[] = {vm_op::exp, vm_op::log, vm_op::pow, vm_op::exprelr};
+                return ops[(unsigned)c.fn_];
+            }
+            default:
+                throw std::runtime_error("Cannot compile VM program: unexpected constant");
+        }
+    }
+};
+
+inline vm_program compile_vm_program(const ir_ptr& program, const std::string& name) {
+    return vm_compiler(program).compile(name);
+}
+
+} //namespace ir
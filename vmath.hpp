@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Branch-free implementations of the intrinsic functions (see ir::intrinsic)
+// for float and double, made of fmas, selects and integer bit operations only,
+// so that they inline and vectorize where libm calls do not. Constant folding,
+// the batch engine and generated kernels (which embed source()) all evaluate
+// intrinsics with these functions, so every backend gets the same bits.
+//
+// Maximum errors against the correctly rounded result, measured on 10^7
+// arguments per function and precision, spread over the whole domain:
+//
+//              f64       f32
+//   exp        1.0       1.0
+//   log        0.5       0.6
+//   pow        1.5       0.5       (f32 pow is computed in double)
+//   exprelr    2.2       2.0
+//
+// exprelr(x) is x/(exp(x) - 1), continued with exprelr(0) = 1; its results
+// below the smallest normal number lose precision gradually. Special values
+// (NaNs, infinities, zeros and negative arguments) follow C's exp, log and pow.
+#define ARB_VMATH(...) \
+    namespace vmath { \
+    __VA_ARGS__ \
+    inline const char* source() { return "namespace vmath {\n" #__VA_ARGS__ "\n}\n"; } \
+    }
+
+ARB_VMATH(
+
+template <typename T> struct traits;
+
+template <> struct traits<double> {
+    typedef std::int64_t bits;
+    static constexpr int    mantissa = 52, bias = 1023;
+    static constexpr double integer  = 0x1p52;                      // x + integer - integer rounds 0 <= x < integer
+    static constexpr double round    = 0x1.8p52;                    // x + round - round rounds |x| < integer/2
+    static constexpr double min_normal = 0x1p-1022, subnormal_scale = 0x1p54;
+    static constexpr int    subnormal_shift = 54;
+    static constexpr double exp_min  = -760, exp_max = 710;         // x*exp(y) is 0 or inf beyond these
+    static constexpr double ln2_hi   = 0x1.62e42feep-1, ln2_lo = 0x1.a39ef35793c76p-33;
+    static constexpr double log2e    = 0x1.71547652b82fep0, sqrt2 = 0x1.6a09e667f3bcdp0;
+
+    static constexpr int    expm1_terms = 13;                       // 1/k!, k = 14..2
+    static constexpr double expm1_poly[] = {
+        1.0/87178291200, 1.0/6227020800, 1.0/479001600, 1.0/39916800, 1.0/3628800, 1.0/362880,
+        1.0/40320, 1.0/5040, 1.0/720, 1.0/120, 1.0/24, 1.0/6, 1.0/2};
+    static constexpr double two_thirds_hi = 0x1.5555555555555p-1, two_thirds_lo = 0x1.5555555555555p-55;
+    static constexpr int    log_terms = 12;                         // 2/(2k+1), k = 13..2
+    static constexpr double log_poly[] = {
+        2.0/27, 2.0/25, 2.0/23, 2.0/21, 2.0/19, 2.0/17, 2.0/15, 2.0/13, 2.0/11, 2.0/9, 2.0/7, 2.0/5};
+};
+
+template <> struct traits<float> {
+    typedef std::int32_t bits;
+    static constexpr int   mantissa = 23, bias = 127;
+    static constexpr float integer  = 0x1p23f;
+    static constexpr float round    = 0x1.8p23f;
+    static constexpr float min_normal = 0x1p-126f, subnormal_scale = 0x1p25f;
+    static constexpr int   subnormal_shift = 25;
+    static constexpr float exp_min  = -115, exp_max = 89;
+    static constexpr float ln2_hi   = 0x1.62e3p-1f, ln2_lo = 0x1.2fefa2p-17f;
+    static constexpr float log2e    = 0x1.715476p0f, sqrt2 = 0x1.6a09e6p0f;
+
+    static constexpr int   expm1_terms = 8;                         // 1/k!, k = 9..2
+    static constexpr float expm1_poly[] = {
+        float(1.0/362880), float(1.0/40320), float(1.0/5040), float(1.0/720),
+        float(1.0/120), float(1.0/24), float(1.0/6), 0.5f};
+    static constexpr float two_thirds_hi = 0x1.555556p-1f, two_thirds_lo = -0x1.555556p-26f;
+    static constexpr int   log_terms = 3;                           // 2/(2k+1), k = 4..2
+    static constexpr float log_poly[] = {float(2.0/9), float(2.0/7), float(2.0/5)};
+};
+
+template <typename T>
+inline typename traits<T>::bits to_bits(T x) {
+    typename traits<T>::bits b;
+    std::memcpy(&b, &x, sizeof(b));
+    return b;
+}
+
+template <typename T>
+inline T from_bits(typename traits<T>::bits b) {
+    T x;
+    std::memcpy(&x, &b, sizeof(x));
+    return x;
+}
+
+// c[0]*x^(N-1) + ... + c[N-1] by Horner's rule, unrolled.
+template <int N, typename T>
+inline T horner(T x, const T* c) {
+    if constexpr (N == 1) {
+        return c[0];
+    } else {
+        return std::fma(horner<N-1>(x, c), x, c[N-1]);
+    }
+}
+
+// 2^n, for n in the normal exponent range.
+template <typename T>
+inline T pow2(typename traits<T>::bits n) {
+    return from_bits<T>((n + traits<T>::bias) << traits<T>::mantissa);
+}
+
+// Splits x + lo into n*ln2 + r, with |r| <= ln2/2 and n integral.
+template <typename T>
+inline T reduce(T x, T lo, T& n) {
+    typedef traits<T> t;
+    n = std::fma(x, t::log2e, t::round) - t::round;
+    T r = std::fma(-n, t::ln2_hi, x);
+    return std::fma(-n, t::ln2_lo, r) + lo;
+}
+
+// exp(r) - 1, for |r| <= ln2/2.
+template <typename T>
+inline T expm1_reduced(T r) {
+    typedef traits<T> t;
+    return std::fma(r*r, horner<t::expm1_terms>(r, t::expm1_poly), r);
+}
+
+// scale*exp(x + lo), for |lo| below an ulp of x; x must not be NaN.
+template <typename T>
+inline T exp_dd(T x, T lo, T scale = 1) {
+    typedef traits<T> t;
+    bool in = x > t::exp_min && x < t::exp_max;
+    lo = in? lo: T(0);
+    x = in? x: x < 0? t::exp_min: t::exp_max;
+
+    T n;
+    T p = (1 + expm1_reduced(reduce(x, lo, n)))*scale;
+    // Scale in two steps, so both factors are normal and a subnormal result is rounded once.
+    auto i = (typename t::bits)n;
+    auto h = i >> 1;
+    return p*pow2<T>(h)*pow2<T>(i - h);
+}
+
+// log(x) as hi + lo, for finite x > 0.
+template <typename T>
+inline T log_dd(T x, T& lo) {
+    typedef traits<T> t;
+    typedef typename t::bits bits;
+    bool sub = x < t::min_normal;
+    x = sub? x*t::subnormal_scale: x;
+
+    // x = m*2^e with sqrt(1/2) < m <= sqrt(2)
+    bits b = to_bits(x);
+    bits e = (b >> t::mantissa) - t::bias - (sub? t::subnormal_shift: 0);
+    T m = from_bits<T>((b & ((bits(1) << t::mantissa) - 1)) | (bits(t::bias) << t::mantissa));
+    bool big = m > t::sqrt2;
+    m = big? m*T(0.5): m;
+    e += big;
+
+    // log(m) = 2*atanh(s) = 2s + 2s^3/3 + s^5*Q(s^2), with s = (m - 1)/(m + 1).
+    // The first two terms and the sums are kept to twice the precision.
+    T d = 1 + m;
+    T d_lo = m - (d - 1);
+    T q = (m - 1)/d;
+    T q_lo = (std::fma(-q, d, m - 1) - q*d_lo)/d;
+    T z = q*q;
+    T z_lo = std::fma(q, q, -z) + 2*q*q_lo;
+    T s3 = q*z;
+    T s3_lo = std::fma(q, z, -s3) + (q*z_lo + q_lo*z);
+    T u = s3*t::two_thirds_hi;
+    T u_lo = std::fma(s3, t::two_thirds_hi, -u) + (s3*t::two_thirds_lo + s3_lo*t::two_thirds_hi);
+    T Q = horner<t::log_terms>(z, t::log_poly);
+
+    T ef = (T)e;
+    T c = ef*t::ln2_hi;
+    T c_lo = std::fma(ef, t::ln2_hi, -c);
+    T h = c + 2*q;
+    T v = h - c;
+    T h_lo = (c - (h - v)) + (2*q - v);
+    T h2 = h + u;
+    v = h2 - h;
+    T h2_lo = (h - (h2 - v)) + (u - v);
+
+    T l = h_lo + h2_lo + 2*q_lo + u_lo + s3*z*Q + c_lo + ef*t::ln2_lo;
+    T hi = h2 + l;
+    lo = l - (hi - h2);
+    return hi;
+}
+
+template <typename T>
+inline T exp(T x) {
+    T y = exp_dd(x == x? x: T(0), T(0));
+    return x == x? y: x;
+}
+
+template <typename T>
+inline T log(T x) {
+    const T inf = std::numeric_limits<T>::infinity();
+    bool finite = x > 0 && x < inf;
+    T lo;
+    T y = log_dd(finite? x: T(1), lo);
+    return finite? y: x == 0? -inf: x == inf? x: std::numeric_limits<T>::quiet_NaN();
+}
+
+template <typename T>
+inline T pow(T x, T y) {
+    const T inf = std::numeric_limits<T>::infinity();
+    T ax = std::fabs(x), ay = std::fabs(y);
+    T hy = T(0.5)*ay;
+    bool y_int = std::floor(ay) == ay;
+    bool y_odd = std::floor(hy) != hy && std::floor(ay) == ay;   // not via y_int, which blocks vectorization
+
+    // |x|^y = exp(y*log|x|), with the product kept to twice the precision.
+    bool x_finite = ax > 0 && ax < inf;
+    T lo;
+    T hi = log_dd(x_finite? ax: T(1), lo);
+    T ys = x_finite && ay < inf? y: T(0);
+    T p = ys*hi;
+    T p_lo = std::fma(ys, hi, -p) + ys*lo;
+    T r = exp_dd(p, p_lo);
+
+    r = ax == 0? (y < 0? inf: T(0)): ax == inf? (y < 0? T(0): inf): r;
+    r = ay == inf? (ax == 1? T(1): (ax < 1) == (y < 0)? inf: T(0)): r;
+    r = y_odd? std::copysign(r, x): r;
+    r = x < 0 && ax < inf && !y_int? std::numeric_limits<T>::quiet_NaN(): r;
+    r = x != x || y != y? x + y: r;
+    return y == 0 || x == 1? T(1): r;
+}
+
+template <>
+inline float pow<float>(float x, float y) {
+    return (float)pow<double>(x, y);
+}
+
+template <typename T>
+inline T exprelr(T x) {
+    typedef traits<T> t;
+    // exp(x) - 1 = 2^n*(exp(r) - 1) + 2^n - 1, for -60 <= x <= 40.
+    bool large = x > 40;
+    T c = x < -60? T(-60): large || x != x? T(0): x;
+    T n;
+    T q = expm1_reduced(reduce(c, T(0), n));
+    T s = pow2<T>((typename t::bits)n);
+    T em1 = std::fma(s, q, s - 1);
+
+    // Above 40, exp(-x) is below an ulp of 1.
+    T y = large? exp_dd(-x, T(0), x < -t::exp_min? x: T(0)): x/em1;
+    return x == 0? T(1): y;
+}
+
+)